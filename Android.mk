@@ -35,9 +35,31 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_STATIC_LIBRARIES := libminzip libunz libamend libmtdutils libmincrypt
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(MINZIP_USE_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 
 include $(BUILD_EXECUTABLE)
 
+# Host test for the whole-file signature check; exits nonzero on failure.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	test_verifier.c \
+	verifier.c
+
+LOCAL_MODULE := verifier_test
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_CFLAGS += -Wall -D_GNU_SOURCE
+LOCAL_STATIC_LIBRARIES := libminzip libmincrypt libz
+LOCAL_LDLIBS += -lpthread -lresolv
+
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/amend/Android.mk
 include $(commands_recovery_local_path)/minzip/Android.mk
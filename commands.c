@@ -276,7 +276,7 @@ cmd_copy_dir(const char *name, void *cookie, int argc, const char *argv[])
                     MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_DRY_RUN,
                     &timestamp, extract_count_cb, (void *) &ctx) ||
             !mzExtractRecursive(package, src_path, dst_path,
-                    MZ_EXTRACT_FILES_ONLY,
+                    MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_PARALLEL,
                     &timestamp, extract_cb, (void *) &ctx)) {
             LOGW("Command %s: couldn't extract \"%s\" to \"%s\"\n",
                     name, src_root_path, dst_root_path);
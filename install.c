@@ -37,6 +37,11 @@
 
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
+// Shared with the updater binary, which opens the same package again.
+#define PACKAGE_INDEX_FILE "/tmp/update_package.idx"
+// Packages that passed verification, so a retried install needn't redo it.
+// This has to be on recovery's own tmpfs; see verifier.h.
+#define VERIFY_CACHE_FILE "/tmp/verified_packages"
 // #define PUBLIC_KEYS_FILE "/res/keys"
 
 static const ZipEntry *
@@ -322,7 +327,8 @@ handle_update_package(const char *path, ZipArchive *zip)
             VERIFICATION_PROGRESS_TIME);
 
 /*
-    if (!verify_jar_signature(zip, keys, numKeys)) {
+    if (!verify_package_signature_cached(VERIFY_CACHE_FILE, path, zip,
+            keys, numKeys)) {
         LOGE("Verification failed\n");
         return INSTALL_CORRUPT;
     }
@@ -467,7 +473,7 @@ install_package(const char *root_path)
     /* Try to open the package.
      */
     ZipArchive zip;
-    int err = mzOpenZipArchive(path, &zip);
+    int err = mzOpenZipArchiveWithIndex(path, PACKAGE_INDEX_FILE, &zip);
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
         return INSTALL_CORRUPT;
@@ -1,13 +1,18 @@
 LOCAL_PATH := $(call my-dir)
-include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := \
+minzip_src_files := \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
+	Decompress.c \
+	Checksum.c \
 	Zip.c
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minzip_src_files)
+
 LOCAL_C_INCLUDES += \
 	external/zlib \
 	external/safe-iop/include
@@ -16,4 +21,73 @@ LOCAL_MODULE := libminzip
 
 LOCAL_CFLAGS += -Wall
 
+# Optional decompressors (see Decompress.h).  Executables that link
+# libminzip must also link the matching libraries.
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_CFLAGS += -DMINZIP_USE_LIBDEFLATE
+LOCAL_C_INCLUDES += external/libdeflate
+endif
+ifeq ($(MINZIP_USE_ZSTD),true)
+LOCAL_CFLAGS += -DMINZIP_USE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+endif
+
 include $(BUILD_STATIC_LIBRARY)
+
+# Host microbenchmark comparing Checksum.c with zlib and mincrypt:
+#     minzip_checksum_bench [megabytes [chunk-kilobytes]]
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	Checksum.c \
+	ChecksumBench.c
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_STATIC_LIBRARIES := libz libmincrypt
+
+LOCAL_MODULE := minzip_checksum_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Host copy of the library, for the benchmarks and tests below and in
+# the recovery directory.  No optional decompressors.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minzip_src_files)
+
+LOCAL_C_INCLUDES += \
+	external/zlib \
+	external/safe-iop/include
+
+LOCAL_MODULE := libminzip
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS += -Wall -D_GNU_SOURCE
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+# Host benchmark for opening a big archive: builds a synthetic STORED
+# archive with its central directory in random order and times
+# mzOpenZipArchive() on it.
+#     minzip_zip_bench [entries [runs]]
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := ZipBench.c
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_STATIC_LIBRARIES := libminzip libz
+
+LOCAL_MODULE := minzip_zip_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS += -Wall -D_GNU_SOURCE
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+minzip_src_files :=
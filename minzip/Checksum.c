@@ -0,0 +1,582 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 and SHA-1, with the implementation picked at run time.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32) || defined(__ARM_FEATURE_CRYPTO)
+#define CHECKSUM_ARM
+#include <sys/auxv.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#endif
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+#include "Checksum.h"
+
+/*
+ * The CPU features we look for, as reported by getauxval().  The bits
+ * are spelled out because not every libc's headers have them.
+ */
+#ifdef CHECKSUM_ARM
+#if defined(__aarch64__)
+#define ARM_HWCAP           AT_HWCAP
+#define ARM_HWCAP_SHA1      (1 << 5)
+#define ARM_HWCAP_CRC32     (1 << 7)
+#else
+#define ARM_HWCAP           AT_HWCAP2
+#define ARM_HWCAP_SHA1      (1 << 2)
+#define ARM_HWCAP_CRC32     (1 << 4)
+#endif
+#endif
+
+#ifdef CHECKSUM_X86
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+#endif
+
+/*
+ * CRC-32 implementations.  These all work on the inverted CRC; mzCrc32()
+ * does the inverting.
+ */
+typedef uint32_t (*Crc32Func)(uint32_t crc, const unsigned char* p,
+        size_t len);
+
+/*
+ * gCrcTable[k][n] is the CRC of byte n followed by k zero bytes, so that
+ * eight bytes can be looked up at once.
+ */
+static uint32_t gCrcTable[8][256];
+
+static void buildCrcTables(void)
+{
+    uint32_t c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = n;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        gCrcTable[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+        c = gCrcTable[0][n];
+        for (k = 1; k < 8; k++) {
+            c = gCrcTable[0][c & 0xff] ^ (c >> 8);
+            gCrcTable[k][n] = c;
+        }
+    }
+}
+
+static uint32_t crc32Slice8(uint32_t crc, const unsigned char* p, size_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = gCrcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = gCrcTable[7][lo & 0xff] ^
+                gCrcTable[6][(lo >> 8) & 0xff] ^
+                gCrcTable[5][(lo >> 16) & 0xff] ^
+                gCrcTable[4][lo >> 24] ^
+                gCrcTable[3][hi & 0xff] ^
+                gCrcTable[2][(hi >> 8) & 0xff] ^
+                gCrcTable[1][(hi >> 16) & 0xff] ^
+                gCrcTable[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len > 0) {
+        crc = gCrcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CHECKSUM_X86
+/*
+ * Fold 64 bytes at a time with carry-less multiplies, then reduce to 32
+ * bits, as in Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction".  "len" must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32FoldPclmul(uint32_t crc, const unsigned char* p,
+        size_t len)
+{
+    /* The bit-reflected fold constants and the CRC-32 and Barrett
+     * polynomials, from the paper.
+     */
+    static const uint64_t __attribute__((aligned(16)))
+            k1k2[] = { 0x0154442bd4, 0x01c6e41596 },
+            k3k4[] = { 0x01751997d0, 0x00ccaa009e },
+            k5k0[] = { 0x0163cd6124, 0x0000000000 },
+            poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    p += 64;
+    len -= 64;
+
+    /* Fold four lanes of 128 bits in parallel.
+     */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*) (p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*) (p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*) (p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*) (p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes into one, then any remaining 16-byte blocks
+     * into that.
+     */
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64.
+     */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits.
+     */
+    x0 = _mm_load_si128((const __m128i*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char* p, size_t len)
+{
+    if (len >= 64) {
+        size_t chunk = len & ~(size_t) 15;
+        crc = crc32FoldPclmul(crc, p, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+    return crc32Slice8(crc, p, len);
+}
+#endif
+
+#ifdef __ARM_FEATURE_CRC32
+static uint32_t crc32Armv8(uint32_t crc, const unsigned char* p, size_t len)
+{
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32d(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+/*
+ * SHA-1 implementations.  Each one hashes "numBlocks" whole 64-byte
+ * blocks into "state".
+ */
+typedef void (*Sha1BlocksFunc)(uint32_t state[5], const unsigned char* p,
+        size_t numBlocks);
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1Portable(uint32_t state[5], const unsigned char* p,
+        size_t numBlocks)
+{
+    while (numBlocks-- > 0) {
+        uint32_t w[16], a, b, c, d, e, f, k, t;
+        int i;
+
+        for (i = 0; i < 16; i++) {
+            w[i] = ((uint32_t) p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+                    (p[4 * i + 2] << 8) | p[4 * i + 3];
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        for (i = 0; i < 80; i++) {
+            if (i >= 16) {
+                t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^
+                        w[(i + 2) & 15] ^ w[i & 15];
+                w[i & 15] = ROL32(t, 1);
+            }
+            if (i < 20) {
+                f = d ^ (b & (c ^ d));
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (d & (b | c));
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            t = ROL32(a, 5) + f + e + k + w[i & 15];
+            e = d;
+            d = c;
+            c = ROL32(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        p += 64;
+    }
+}
+
+#ifdef CHECKSUM_X86
+/*
+ * With the SHA extensions, four rounds at a time.  The E value for each
+ * group of rounds comes from A four rounds earlier, so it alternates
+ * between two registers.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha1ShaNi(uint32_t state[5], const unsigned char* p,
+        size_t numBlocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL,
+            0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcdSave, e0, e1, e0Save;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1b);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+/* The next four message words, from the previous sixteen. */
+#define SHA1_NEXT_MSG(m0, m1, m2, m3) \
+    m0 = _mm_sha1msg2_epu32( \
+            _mm_xor_si128(_mm_sha1msg1_epu32(m0, m1), m2), m3)
+
+/* Four rounds of function "f" using message words "m". */
+#define SHA1_ROUNDS4(eIn, eOut, m, f) \
+    eIn = _mm_sha1nexte_epu32(eIn, m); \
+    eOut = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, eIn, f)
+
+    while (numBlocks-- > 0) {
+        abcdSave = abcd;
+        e0Save = e0;
+
+        msg0 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (p + 0)), byteSwap);
+        msg1 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (p + 16)), byteSwap);
+        msg2 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (p + 32)), byteSwap);
+        msg3 = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (p + 48)), byteSwap);
+
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        SHA1_ROUNDS4(e1, e0, msg1, 0);
+        SHA1_ROUNDS4(e0, e1, msg2, 0);
+        SHA1_ROUNDS4(e1, e0, msg3, 0);
+        SHA1_NEXT_MSG(msg0, msg1, msg2, msg3);
+        SHA1_ROUNDS4(e0, e1, msg0, 0);
+
+        SHA1_NEXT_MSG(msg1, msg2, msg3, msg0);
+        SHA1_ROUNDS4(e1, e0, msg1, 1);
+        SHA1_NEXT_MSG(msg2, msg3, msg0, msg1);
+        SHA1_ROUNDS4(e0, e1, msg2, 1);
+        SHA1_NEXT_MSG(msg3, msg0, msg1, msg2);
+        SHA1_ROUNDS4(e1, e0, msg3, 1);
+        SHA1_NEXT_MSG(msg0, msg1, msg2, msg3);
+        SHA1_ROUNDS4(e0, e1, msg0, 1);
+        SHA1_NEXT_MSG(msg1, msg2, msg3, msg0);
+        SHA1_ROUNDS4(e1, e0, msg1, 1);
+
+        SHA1_NEXT_MSG(msg2, msg3, msg0, msg1);
+        SHA1_ROUNDS4(e0, e1, msg2, 2);
+        SHA1_NEXT_MSG(msg3, msg0, msg1, msg2);
+        SHA1_ROUNDS4(e1, e0, msg3, 2);
+        SHA1_NEXT_MSG(msg0, msg1, msg2, msg3);
+        SHA1_ROUNDS4(e0, e1, msg0, 2);
+        SHA1_NEXT_MSG(msg1, msg2, msg3, msg0);
+        SHA1_ROUNDS4(e1, e0, msg1, 2);
+        SHA1_NEXT_MSG(msg2, msg3, msg0, msg1);
+        SHA1_ROUNDS4(e0, e1, msg2, 2);
+
+        SHA1_NEXT_MSG(msg3, msg0, msg1, msg2);
+        SHA1_ROUNDS4(e1, e0, msg3, 3);
+        SHA1_NEXT_MSG(msg0, msg1, msg2, msg3);
+        SHA1_ROUNDS4(e0, e1, msg0, 3);
+        SHA1_NEXT_MSG(msg1, msg2, msg3, msg0);
+        SHA1_ROUNDS4(e1, e0, msg1, 3);
+        SHA1_NEXT_MSG(msg2, msg3, msg0, msg1);
+        SHA1_ROUNDS4(e0, e1, msg2, 3);
+        SHA1_NEXT_MSG(msg3, msg0, msg1, msg2);
+        SHA1_ROUNDS4(e1, e0, msg3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0Save);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+        p += 64;
+    }
+#undef SHA1_NEXT_MSG
+#undef SHA1_ROUNDS4
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    _mm_storeu_si128((__m128i*) state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+#ifdef __ARM_FEATURE_CRYPTO
+/*
+ * With the ARMv8 SHA1 instructions, four rounds at a time.
+ */
+static void sha1Armv8(uint32_t state[5], const unsigned char* p,
+        size_t numBlocks)
+{
+    static const uint32_t k[4] = {
+        0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+    };
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (numBlocks-- > 0) {
+        uint32x4_t abcdSave = abcd;
+        uint32_t eSave = e;
+        uint32x4_t w[4];
+        int g;
+
+        for (g = 0; g < 4; g++) {
+            w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * g)));
+        }
+        for (g = 0; g < 20; g++) {
+            uint32x4_t wk;
+            uint32_t eNext;
+
+            if (g >= 4) {
+                w[g & 3] = vsha1su1q_u32(vsha1su0q_u32(w[g & 3],
+                        w[(g + 1) & 3], w[(g + 2) & 3]), w[(g + 3) & 3]);
+            }
+            wk = vaddq_u32(w[g & 3], vdupq_n_u32(k[g / 5]));
+            eNext = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (g < 5) {
+                abcd = vsha1cq_u32(abcd, e, wk);
+            } else if (g >= 10 && g < 15) {
+                abcd = vsha1mq_u32(abcd, e, wk);
+            } else {
+                abcd = vsha1pq_u32(abcd, e, wk);
+            }
+            e = eNext;
+        }
+        abcd = vaddq_u32(abcd, abcdSave);
+        e += eSave;
+        p += 64;
+    }
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+#endif
+
+/*
+ * Run-time selection.
+ */
+static pthread_once_t gChecksumOnce = PTHREAD_ONCE_INIT;
+static Crc32Func gCrc32 = crc32Slice8;
+static const char* gCrc32Name = "slice-by-8";
+static Sha1BlocksFunc gSha1Blocks = sha1Portable;
+static const char* gSha1Name = "portable";
+
+static void chooseImplementations(void)
+{
+    buildCrcTables();
+
+#ifdef CHECKSUM_X86
+    unsigned int eax, ebx, ecx, edx;
+    bool sse41 = false, ssse3 = false;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        sse41 = (ecx & bit_SSE4_1) != 0;
+        ssse3 = (ecx & bit_SSSE3) != 0;
+        if (sse41 && (ecx & bit_PCLMUL) != 0) {
+            gCrc32 = crc32Pclmul;
+            gCrc32Name = "pclmul";
+        }
+    }
+    if (sse41 && ssse3 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+        (ebx & bit_SHA) != 0)
+    {
+        gSha1Blocks = sha1ShaNi;
+        gSha1Name = "sha-ni";
+    }
+#endif
+
+#ifdef CHECKSUM_ARM
+    unsigned long hwcap = getauxval(ARM_HWCAP);
+#ifdef __ARM_FEATURE_CRC32
+    if (hwcap & ARM_HWCAP_CRC32) {
+        gCrc32 = crc32Armv8;
+        gCrc32Name = "armv8-crc32";
+    }
+#endif
+#ifdef __ARM_FEATURE_CRYPTO
+    if (hwcap & ARM_HWCAP_SHA1) {
+        gSha1Blocks = sha1Armv8;
+        gSha1Name = "armv8-sha1";
+    }
+#endif
+    (void) hwcap;
+#endif
+
+    LOGV("Checksums: crc32=%s sha1=%s\n", gCrc32Name, gSha1Name);
+}
+
+uint32_t mzCrc32(uint32_t crc, const void* data, size_t len)
+{
+    pthread_once(&gChecksumOnce, chooseImplementations);
+    return ~gCrc32(~crc, (const unsigned char*) data, len);
+}
+
+void mzSha1Init(MzSha1Context* ctx)
+{
+    pthread_once(&gChecksumOnce, chooseImplementations);
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->count = 0;
+}
+
+void mzSha1Update(MzSha1Context* ctx, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+    if (used > 0) {
+        size_t room = 64 - used;
+        if (len < room) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, room);
+        gSha1Blocks(ctx->state, ctx->buf, 1);
+        p += room;
+        len -= room;
+    }
+    if (len >= 64) {
+        gSha1Blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t) 63;
+        len &= 63;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+void mzSha1Final(MzSha1Context* ctx, uint8_t digest[MZ_SHA1_DIGEST_SIZE])
+{
+    static const unsigned char padding[64] = { 0x80 };
+    uint64_t bits = ctx->count * 8;
+    size_t used = ctx->count & 63;
+    unsigned char length[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        length[i] = (unsigned char) (bits >> (56 - 8 * i));
+    }
+    mzSha1Update(ctx, padding, (used < 56) ? 56 - used : 120 - used);
+    mzSha1Update(ctx, length, sizeof(length));
+
+    for (i = 0; i < 5; i++) {
+        digest[4 * i] = (uint8_t) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) ctx->state[i];
+    }
+}
+
+const char* mzCrc32Implementation(void)
+{
+    pthread_once(&gChecksumOnce, chooseImplementations);
+    return gCrc32Name;
+}
+
+const char* mzSha1Implementation(void)
+{
+    pthread_once(&gChecksumOnce, chooseImplementations);
+    return gSha1Name;
+}
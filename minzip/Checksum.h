@@ -0,0 +1,48 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 and SHA-1, using the fastest implementation the CPU supports.
+ *
+ * The choice is made once, at the first call, from what the CPU reports
+ * at run time:
+ *
+ *     CRC-32: ARMv8 CRC32 instructions, or PCLMULQDQ folding on x86;
+ *         otherwise slice-by-8 tables
+ *     SHA-1: the ARMv8 SHA1 instructions, or the x86 SHA extensions;
+ *         otherwise portable C
+ *
+ * The ARM versions are only compiled in when the compiler is allowed to
+ * use those instructions (__ARM_FEATURE_CRC32, __ARM_FEATURE_CRYPTO).
+ */
+#ifndef _MINZIP_CHECKSUM
+#define _MINZIP_CHECKSUM
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MZ_SHA1_DIGEST_SIZE 20
+
+/*
+ * Add "len" bytes to a running CRC-32.  Start with 0; the results are
+ * the same as zlib's crc32(), which Zip uses.
+ */
+uint32_t mzCrc32(uint32_t crc, const void* data, size_t len);
+
+typedef struct {
+    uint32_t        state[5];
+    uint64_t        count;          // bytes hashed so far
+    unsigned char   buf[64];        // partial block
+} MzSha1Context;
+
+void mzSha1Init(MzSha1Context* ctx);
+void mzSha1Update(MzSha1Context* ctx, const void* data, size_t len);
+void mzSha1Final(MzSha1Context* ctx, uint8_t digest[MZ_SHA1_DIGEST_SIZE]);
+
+/*
+ * Names of the implementations in use, e.g. "pclmul" and "sha-ni", for
+ * logging and benchmarks.
+ */
+const char* mzCrc32Implementation(void);
+const char* mzSha1Implementation(void);
+
+#endif /*_MINZIP_CHECKSUM*/
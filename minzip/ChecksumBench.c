@@ -0,0 +1,106 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Microbenchmark for Checksum.c: times mzCrc32() against zlib's crc32()
+ * and the mzSha1 functions against mincrypt's SHA_update(), over the same
+ * buffer, and checks that they agree.
+ *
+ *     minzip_checksum_bench [megabytes [chunk-kilobytes]]
+ *
+ * The data is fed in chunks (32K by default, like the Zip code does).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zlib.h"
+#include "mincrypt/sha.h"
+
+#include "Checksum.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* what, const char* impl, size_t len,
+        double secs)
+{
+    printf("%-6s %-12s %8.1f MB/s\n", what, impl, len / secs / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+    size_t len = (argc > 1 ? atoi(argv[1]) : 64) * 1024 * 1024;
+    size_t chunk = (argc > 2 ? atoi(argv[2]) : 32) * 1024;
+    unsigned char* buf;
+    size_t i, pos;
+    double start;
+
+    if (len == 0 || chunk == 0) {
+        fprintf(stderr, "usage: %s [megabytes [chunk-kilobytes]]\n", argv[0]);
+        return 2;
+    }
+    buf = (unsigned char*) malloc(len);
+    if (buf == NULL) {
+        fprintf(stderr, "can't allocate %zu bytes\n", len);
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < len; i++) {
+        buf[i] = rand();
+    }
+
+    /* CRC-32.
+     */
+    uLong zcrc = crc32(0L, Z_NULL, 0);
+    start = now();
+    for (pos = 0; pos < len; pos += chunk) {
+        zcrc = crc32(zcrc, buf + pos, (len - pos < chunk) ? len - pos : chunk);
+    }
+    report("crc32", "zlib", len, now() - start);
+
+    uint32_t crc = 0;
+    start = now();
+    for (pos = 0; pos < len; pos += chunk) {
+        crc = mzCrc32(crc, buf + pos, (len - pos < chunk) ? len - pos : chunk);
+    }
+    report("crc32", mzCrc32Implementation(), len, now() - start);
+
+    /* SHA-1.
+     */
+    SHA_CTX sha;
+    uint8_t expected[SHA_DIGEST_SIZE];
+    SHA_init(&sha);
+    start = now();
+    for (pos = 0; pos < len; pos += chunk) {
+        SHA_update(&sha, buf + pos, (len - pos < chunk) ? len - pos : chunk);
+    }
+    memcpy(expected, SHA_final(&sha), SHA_DIGEST_SIZE);
+    report("sha1", "mincrypt", len, now() - start);
+
+    MzSha1Context ctx;
+    uint8_t actual[MZ_SHA1_DIGEST_SIZE];
+    mzSha1Init(&ctx);
+    start = now();
+    for (pos = 0; pos < len; pos += chunk) {
+        mzSha1Update(&ctx, buf + pos, (len - pos < chunk) ? len - pos : chunk);
+    }
+    mzSha1Final(&ctx, actual);
+    report("sha1", mzSha1Implementation(), len, now() - start);
+
+    free(buf);
+    if (crc != (uint32_t) zcrc) {
+        printf("CRC-32 mismatch: %08x vs %08lx\n", crc, zcrc);
+        return 1;
+    }
+    if (memcmp(expected, actual, SHA_DIGEST_SIZE) != 0) {
+        printf("SHA-1 mismatch\n");
+        return 1;
+    }
+    return 0;
+}
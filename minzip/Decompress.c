@@ -0,0 +1,259 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Decompressors for the compression methods of Zip entries.
+ */
+#include "zlib.h"
+#ifdef MINZIP_USE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+#ifdef MINZIP_USE_ZSTD
+#include "zstd.h"
+#endif
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+#include "Decompress.h"
+
+/*
+ * zlib takes lengths as uInt; hand it at most this much at a time.
+ */
+#define ZLIB_MAX_CHUNK  UINT_MAX
+
+/*
+ * Raw deflate, with zlib.
+ */
+static void* zlibBegin(void)
+{
+    z_stream* pStream = (z_stream*) calloc(1, sizeof(z_stream));
+    int zerr;
+
+    if (pStream == NULL) {
+        return NULL;
+    }
+    pStream->data_type = Z_UNKNOWN;
+
+    /*
+     * Use the undocumented "negative window bits" feature to tell zlib
+     * that there's no zlib header waiting for it.
+     */
+    zerr = inflateInit2(pStream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        if (zerr == Z_VERSION_ERROR) {
+            LOGE("Installed zlib is not compatible with linked version (%s)\n",
+                ZLIB_VERSION);
+        } else {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        }
+        free(pStream);
+        return NULL;
+    }
+    return pStream;
+}
+
+static int zlibRun(void* state, const unsigned char** pIn,
+    size_t* pInLen, unsigned char** pOut, size_t* pOutLen)
+{
+    z_stream* pStream = (z_stream*) state;
+    uInt inLen = *pInLen > ZLIB_MAX_CHUNK ? ZLIB_MAX_CHUNK : *pInLen;
+    uInt outLen = *pOutLen > ZLIB_MAX_CHUNK ? ZLIB_MAX_CHUNK : *pOutLen;
+    int zerr;
+
+    pStream->next_in = (Bytef*) *pIn;
+    pStream->avail_in = inLen;
+    pStream->next_out = *pOut;
+    pStream->avail_out = outLen;
+
+    /* Z_BUF_ERROR means that no progress was possible.
+     */
+    zerr = inflate(pStream, Z_NO_FLUSH);
+
+    *pIn += inLen - pStream->avail_in;
+    *pInLen -= inLen - pStream->avail_in;
+    *pOut += outLen - pStream->avail_out;
+    *pOutLen -= outLen - pStream->avail_out;
+
+    if (zerr == Z_STREAM_END) {
+        return DECOMP_END;
+    }
+    if (zerr != Z_OK) {
+        LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+        return DECOMP_ERROR;
+    }
+    return DECOMP_OK;
+}
+
+static void zlibFinish(void* state)
+{
+    z_stream* pStream = (z_stream*) state;
+
+    inflateEnd(pStream);
+    free(pStream);
+}
+
+static bool zlibDecodeAll(const unsigned char* in, size_t inLen,
+    unsigned char* out, size_t outLen)
+{
+    z_stream zstream;
+    int zerr;
+
+    if (inLen > ZLIB_MAX_CHUNK || outLen > ZLIB_MAX_CHUNK) {
+        return false;
+    }
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = (Bytef*) in;
+    zstream.avail_in = inLen;
+    zstream.next_out = out;
+    zstream.avail_out = outLen;
+    zstream.data_type = Z_UNKNOWN;
+
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+
+    /* With all of the output space there is, Z_FINISH lets inflate skip
+     * keeping a copy of its window.
+     */
+    zerr = inflate(&zstream, Z_FINISH);
+    inflateEnd(&zstream);
+    if (zerr != Z_STREAM_END) {
+        LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    if (zstream.avail_out != 0) {
+        LOGW("Size mismatch on inflated file (%zu vs %zu)\n",
+            outLen - zstream.avail_out, outLen);
+        return false;
+    }
+    return true;
+}
+
+#ifdef MINZIP_USE_LIBDEFLATE
+/*
+ * Whole-buffer raw deflate, with libdeflate.  If a decompressor can't be
+ * allocated, zlib does the job instead.
+ */
+static bool libdeflateDecodeAll(const unsigned char* in, size_t inLen,
+    unsigned char* out, size_t outLen)
+{
+    struct libdeflate_decompressor* d;
+    enum libdeflate_result result;
+
+    d = libdeflate_alloc_decompressor();
+    if (d == NULL) {
+        return zlibDecodeAll(in, inLen, out, outLen);
+    }
+
+    /* Without an "actual size" pointer, libdeflate insists on filling
+     * the output exactly.
+     */
+    result = libdeflate_deflate_decompress(d, in, inLen, out, outLen, NULL);
+    libdeflate_free_decompressor(d);
+    if (result != LIBDEFLATE_SUCCESS) {
+        LOGD("libdeflate failed (result=%d)\n", result);
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef MINZIP_USE_ZSTD
+/*
+ * Zstandard, method 93.  Each entry is a single frame.
+ */
+static void* zstdBegin(void)
+{
+    ZSTD_DStream* pStream = ZSTD_createDStream();
+
+    if (pStream != NULL && ZSTD_isError(ZSTD_initDStream(pStream))) {
+        ZSTD_freeDStream(pStream);
+        pStream = NULL;
+    }
+    return pStream;
+}
+
+static int zstdRun(void* state, const unsigned char** pIn,
+    size_t* pInLen, unsigned char** pOut, size_t* pOutLen)
+{
+    ZSTD_inBuffer input = { *pIn, *pInLen, 0 };
+    ZSTD_outBuffer output = { *pOut, *pOutLen, 0 };
+    size_t ret;
+
+    ret = ZSTD_decompressStream((ZSTD_DStream*) state, &output, &input);
+
+    *pIn += input.pos;
+    *pInLen -= input.pos;
+    *pOut += output.pos;
+    *pOutLen -= output.pos;
+
+    if (ZSTD_isError(ret)) {
+        LOGD("zstd call failed (%s)\n", ZSTD_getErrorName(ret));
+        return DECOMP_ERROR;
+    }
+    if (ret == 0) {
+        return DECOMP_END;
+    }
+    if (input.pos == 0 && output.pos == 0) {
+        return DECOMP_ERROR;
+    }
+    return DECOMP_OK;
+}
+
+static void zstdFinish(void* state)
+{
+    ZSTD_freeDStream((ZSTD_DStream*) state);
+}
+
+static bool zstdDecodeAll(const unsigned char* in, size_t inLen,
+    unsigned char* out, size_t outLen)
+{
+    size_t ret = ZSTD_decompress(out, outLen, in, inLen);
+
+    if (ZSTD_isError(ret)) {
+        LOGD("zstd call failed (%s)\n", ZSTD_getErrorName(ret));
+        return false;
+    }
+    if (ret != outLen) {
+        LOGW("Size mismatch on decompressed file (%zu vs %zu)\n",
+            ret, outLen);
+        return false;
+    }
+    return true;
+}
+#endif
+
+static const Decompressor gDecompressors[] = {
+    {
+        ZIP_METHOD_DEFLATED, "deflate",
+        zlibBegin, zlibRun, zlibFinish,
+#ifdef MINZIP_USE_LIBDEFLATE
+        libdeflateDecodeAll,
+#else
+        zlibDecodeAll,
+#endif
+    },
+#ifdef MINZIP_USE_ZSTD
+    {
+        ZIP_METHOD_ZSTD, "zstd",
+        zstdBegin, zstdRun, zstdFinish, zstdDecodeAll,
+    },
+#endif
+};
+
+const Decompressor* mzFindDecompressor(int method)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(gDecompressors) / sizeof(gDecompressors[0]); i++) {
+        if (gDecompressors[i].method == method) {
+            return &gDecompressors[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Decompressors for the compression methods of Zip entries.
+ *
+ * zlib's inflate handles DEFLATED entries unless something faster is
+ * built in.  Other methods are only available when their library is:
+ *
+ *     MINZIP_USE_LIBDEFLATE - decode whole DEFLATED entries with
+ *         libdeflate, which is a good deal faster than inflate when all
+ *         of the input and output is in memory; streaming still uses zlib
+ *     MINZIP_USE_ZSTD - method 93 (Zstandard)
+ */
+#ifndef _MINZIP_DECOMPRESS
+#define _MINZIP_DECOMPRESS
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Compression methods, as found in the Zip headers.
+ */
+enum {
+    ZIP_METHOD_STORED = 0,
+    ZIP_METHOD_DEFLATED = 8,
+    ZIP_METHOD_ZSTD = 93,
+};
+
+/*
+ * Results of Decompressor.run().
+ */
+enum {
+    DECOMP_OK,          // made progress; call again with more room or data
+    DECOMP_END,         // the end of the compressed data has been reached
+    DECOMP_ERROR,       // corrupt data, out of memory, or no progress made
+};
+
+typedef struct Decompressor {
+    int         method;
+    const char* name;
+
+    /*
+     * Streaming interface.  begin() returns the state for one entry, or
+     * NULL on failure.  run() decodes from [*pIn, *pIn + *pInLen) into
+     * [*pOut, *pOut + *pOutLen), advancing both pointers and shrinking
+     * both lengths by the amount used.  A call that can't consume or
+     * produce anything returns DECOMP_ERROR rather than looping forever.
+     * end() releases the state.
+     */
+    void*       (*begin)(void);
+    int         (*run)(void* state, const unsigned char** pIn,
+                        size_t* pInLen, unsigned char** pOut, size_t* pOutLen);
+    void        (*end)(void* state);
+
+    /*
+     * Decode all of "in" into "out", which must come out exactly "outLen"
+     * bytes long.  Used when both are in memory in one piece.
+     */
+    bool        (*decodeAll)(const unsigned char* in, size_t inLen,
+                        unsigned char* out, size_t outLen);
+} Decompressor;
+
+/*
+ * Get the decompressor for a compression method, or NULL if the method
+ * isn't supported by this build.  STORED has no decompressor.
+ */
+const Decompressor* mzFindDecompressor(int method);
+
+#endif /*_MINZIP_DECOMPRESS*/
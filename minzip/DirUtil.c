@@ -22,9 +22,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
 
 #include "DirUtil.h"
+#include "Hash.h"
 
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
@@ -103,8 +105,10 @@ dirCreateHierarchy(const char *path, int mode,
      */
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        free(cpath);
         return 0;
     } else if (ds == DILLEGAL) {
+        free(cpath);
         return -1;
     }
 
@@ -165,6 +169,298 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+/* Don't hold more than this many directories open at once.  Past the
+ * limit, directories are still recorded, but are reached by path.
+ */
+#define DIR_CACHE_MAX_FDS 128
+
+/* The key of a cached directory: its path, not NUL-terminated.
+ */
+typedef struct {
+    const char *path;
+    size_t len;
+} DirKey;
+
+typedef struct {
+    DirKey key;         // must be first; the table compares DirKeys
+    int fd;             // O_DIRECTORY descriptor, or -1
+} CachedDir;
+
+struct DirCache {
+    HashTable *dirs;
+    int numFds;
+    char *buf;          // scratch copy of the path being created
+    size_t bufLen;
+};
+
+static unsigned int
+hashDirKey(const char *path, size_t len)
+{
+    unsigned int hash = 1;
+
+    while (len--) {
+        hash = hash * 31 + (unsigned char) *path++;
+    }
+    return hash;
+}
+
+static int
+compareDirKeys(const void *tableItem, const void *looseItem)
+{
+    const DirKey *a = (const DirKey *) tableItem;
+    const DirKey *b = (const DirKey *) looseItem;
+
+    if (a->len != b->len) {
+        return (a->len < b->len) ? -1 : 1;
+    }
+    return memcmp(a->path, b->path, a->len);
+}
+
+static void
+freeCachedDir(void *ptr)
+{
+    CachedDir *dir = (CachedDir *) ptr;
+
+    if (dir->fd >= 0) {
+        close(dir->fd);
+    }
+    free(dir);
+}
+
+static CachedDir *
+findCachedDir(DirCache *cache, const char *path, size_t len)
+{
+    DirKey key = { path, len };
+
+    return (CachedDir *) mzHashTableLookup(cache->dirs,
+            hashDirKey(path, len), &key, compareDirKeys, false);
+}
+
+/* Record the directory at the first "len" bytes of "path", taking
+ * ownership of "fd".  Returns the descriptor to create its children
+ * relative to, which is AT_FDCWD if there isn't one.
+ */
+static int
+addCachedDir(DirCache *cache, const char *path, size_t len, int fd)
+{
+    CachedDir *dir = (CachedDir *) malloc(sizeof(CachedDir) + len);
+
+    if (dir == NULL) {
+        /* Forgetting it costs nothing but a later lookup.
+         */
+        if (fd >= 0) {
+            close(fd);
+        }
+        return AT_FDCWD;
+    }
+    memcpy(dir + 1, path, len);
+    dir->key.path = (const char *) (dir + 1);
+    dir->key.len = len;
+    dir->fd = fd;
+    if (fd >= 0) {
+        cache->numFds++;
+    }
+    mzHashTableLookup(cache->dirs, hashDirKey(path, len), dir,
+            compareDirKeys, true);
+    return (fd >= 0) ? fd : AT_FDCWD;
+}
+
+DirCache *
+dirCacheCreate(void)
+{
+    DirCache *cache = (DirCache *) calloc(1, sizeof(DirCache));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->dirs = mzHashTableCreate(64, freeCachedDir);
+    if (cache->dirs == NULL) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void
+dirCacheFree(DirCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    mzHashTableFree(cache->dirs);
+    free(cache->buf);
+    free(cache);
+}
+
+/* Open the directory "name" (relative to "parentFd") for use as a
+ * cache entry, or just make sure it is one if we're holding too many
+ * open already.  Returns the descriptor, -1 if it's over the limit, or
+ * -2 (with errno set) if "name" isn't a usable directory.
+ */
+static int
+openCachedDir(DirCache *cache, int parentFd, const char *name)
+{
+    struct stat st;
+    int fd;
+
+    if (cache->numFds < DIR_CACHE_MAX_FDS) {
+        fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return (fd >= 0) ? fd : -2;
+    }
+    if (fstatat(parentFd, name, &st, 0) != 0) {
+        return -2;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -2;
+    }
+    return -1;
+}
+
+int
+dirCacheCreateHierarchy(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName)
+{
+    CachedDir *base;
+    size_t len, end, p;
+    int parentFd, fd;
+
+    if (path[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Find the directory part of the path, without any trailing
+     * slashes, and make a copy we can chop up.
+     */
+    len = strlen(path);
+    if (stripFileName) {
+        while (len > 0 && path[len - 1] != '/') {
+            len--;
+        }
+        if (len <= 1) {
+            /* No directory component.  Act like the path was empty.
+             */
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    if (len == 1 && path[0] == '/') {
+        return 0;
+    }
+    if (len + 1 > cache->bufLen) {
+        char *newBuf = (char *) realloc(cache->buf, len + 1);
+        if (newBuf == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        cache->buf = newBuf;
+        cache->bufLen = len + 1;
+    }
+    memcpy(cache->buf, path, len);
+    cache->buf[len] = '\0';
+
+    /* Find the deepest directory on the path that we know about.
+     * Usually that's the directory itself, and we're done.
+     */
+    base = NULL;
+    end = len;
+    while (end > 0) {
+        base = findCachedDir(cache, cache->buf, end);
+        if (base != NULL) {
+            break;
+        }
+        while (end > 0 && cache->buf[end - 1] != '/') {
+            end--;
+        }
+        while (end > 0 && cache->buf[end - 1] == '/') {
+            end--;
+        }
+    }
+    if (base != NULL && end == len) {
+        return 0;
+    }
+
+    /* Names are relative to the parent's descriptor if there is one,
+     * or else the whole path so far is used.
+     */
+    parentFd = (base != NULL && base->fd >= 0) ? base->fd : AT_FDCWD;
+    p = end;
+    while (cache->buf[p] == '/') {
+        p++;
+    }
+
+    /* Most of the time the rest of the path either all exists or
+     * doesn't, so try it in one go first.
+     */
+    fd = openCachedDir(cache, parentFd,
+            (parentFd == AT_FDCWD) ? cache->buf : cache->buf + p);
+    if (fd >= -1) {
+        addCachedDir(cache, cache->buf, len, fd);
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+
+    /* Walk down the rest of the path and make each level.
+     * If a directory already exists, no big deal.
+     */
+    while (p < len) {
+        size_t q = p;
+        bool created;
+
+        while (q < len && cache->buf[q] != '/') {
+            q++;
+        }
+        cache->buf[q] = '\0';
+        const char *name = (parentFd == AT_FDCWD) ?
+                cache->buf : cache->buf + p;
+
+        if (mkdirat(parentFd, name, mode) == 0) {
+            created = true;
+        } else if (errno == EEXIST) {
+            created = false;
+        } else {
+            return -1;
+        }
+        if (created && timestamp != NULL) {
+            struct timespec times[2];
+
+            times[0].tv_sec = timestamp->actime;
+            times[0].tv_nsec = 0;
+            times[1].tv_sec = timestamp->modtime;
+            times[1].tv_nsec = 0;
+            if (utimensat(parentFd, name, times, 0) != 0) {
+                return -1;
+            }
+        }
+        fd = openCachedDir(cache, parentFd, name);
+        if (fd < -1) {
+            /* Could happen if some other process/thread is
+             * messing with the filesystem.
+             */
+            return -1;
+        }
+        parentFd = addCachedDir(cache, cache->buf, q, fd);
+
+        /* Repair the path and continue.
+         */
+        if (q < len) {
+            cache->buf[q] = '/';
+        }
+        p = q;
+        while (p < len && cache->buf[p] == '/') {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
 int
 dirUnlinkHierarchy(const char *path)
 {
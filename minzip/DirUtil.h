@@ -36,6 +36,35 @@
 int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName);
 
+/* A record of the directories known to exist, for creating the
+ * directories of many files in a row without looking each path up
+ * again.  Every directory the cache has seen is kept in a hash table
+ * keyed by its path, with an open descriptor for as many of them as
+ * the cache is willing to hold open, and new directories are created
+ * with mkdirat() relative to their parent's descriptor.
+ *
+ * The cache trusts itself: a directory removed behind its back after
+ * it was recorded is not noticed.  Only use it for as long as nothing
+ * else is changing the tree, e.g. for the duration of one extraction.
+ */
+typedef struct DirCache DirCache;
+
+/* Returns NULL if out of memory.
+ */
+DirCache *dirCacheCreate(void);
+
+/* Closes the descriptors held by the cache and frees it.
+ */
+void dirCacheFree(DirCache *cache);
+
+/* Same as dirCreateHierarchy(), except that directories already in
+ * "cache" aren't checked again, and everything found or created is
+ * added to it.  Paths are used exactly as given, so the same directory
+ * should always be named the same way.
+ */
+int dirCacheCreateHierarchy(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -140,8 +141,11 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 }
 
 /*
- * Map part of a file (from fd's current offset) into a shared, read-only
- * memory segment.
+ * Map part of a file into a shared, read-only memory segment.  "start" is
+ * an absolute file offset.
+ *
+ * This doesn't touch the file position, so it's safe to call from several
+ * threads on the same fd.
  *
  * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
  * value and does not disturb "pMap".
@@ -149,7 +153,7 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap)
 {
-    off_t dummy;
+    struct stat st;
     size_t fileLength, actualLength;
     off_t actualStart;
     int adjust;
@@ -157,8 +161,11 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
 
     assert(pMap != NULL);
 
-    if (getFileStartAndLength(fd, &dummy, &fileLength) < 0)
+    if (fstat(fd, &st) < 0) {
+        LOGE("could not determine length of file\n");
         return -1;
+    }
+    fileLength = st.st_size;
 
     if (start + length > (long)fileLength) {
         LOGW("bad segment: st=%d len=%ld flen=%d\n",
@@ -192,6 +199,45 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     return 0;
 }
 
+/*
+ * Read part of a file into a new anonymous memory segment, with pread()
+ * so that the file position isn't disturbed.
+ *
+ * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
+ * value and does not disturb "pMap".
+ */
+int sysLoadFileSegmentInShmem(int fd, long long start, size_t length,
+    MemMapping* pMap)
+{
+    size_t actual = 0;
+    void* memPtr;
+
+    assert(pMap != NULL);
+
+    memPtr = sysCreateAnonShmem(length);
+    if (memPtr == NULL)
+        return -1;
+
+    while (actual < length) {
+        ssize_t n = pread64(fd, (char*)memPtr + actual, length - actual,
+                start + actual);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOGE("only read %d of %d bytes at %lld\n",
+                (int) actual, (int) length, start);
+            munmap(memPtr, length);
+            return -1;
+        }
+        actual += n;
+    }
+
+    pMap->baseAddr = pMap->addr = memPtr;
+    pMap->baseLength = pMap->length = length;
+
+    return 0;
+}
+
 /*
  * Release a memory mapping.
  */
@@ -51,6 +51,15 @@ int sysMapFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap);
 
+/*
+ * Like sysMapFileSegmentInShmem, but reads the data into anonymous memory
+ * instead of mapping the file.  This works at any offset, even where
+ * mmap() can't reach, and the result is released with sysReleaseShmem()
+ * all the same.
+ */
+int sysLoadFileSegmentInShmem(int fd, long long start, size_t length,
+    MemMapping* pMap);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
@@ -58,4 +67,16 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
  */
 void sysReleaseShmem(MemMapping* pMap);
 
+/*
+ * The nanosecond parts of a struct stat's mtime and ctime.  bionic calls
+ * them st_*time_nsec; glibc keeps them in st_*tim.
+ */
+#ifdef HAVE_ANDROID_OS
+#define SYS_STAT_MTIME_NSEC(st) ((st)->st_mtime_nsec)
+#define SYS_STAT_CTIME_NSEC(st) ((st)->st_ctime_nsec)
+#else
+#define SYS_STAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#define SYS_STAT_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
 #endif /*_MINZIP_SYSUTIL*/
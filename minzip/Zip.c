@@ -3,14 +3,16 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
 #include "zlib.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/falloc.h>   // for FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -19,11 +21,17 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "Decompress.h"
+#include "Checksum.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*
  * Offset and length constants (java.util.zip naming convention).
@@ -77,12 +85,35 @@ enum {
     LOCNAM = 26,
     LOCEXT = 28,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67, Zip64 end-of-central-dir locator
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66, Zip64 end-of-central-dir record
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTID = 0x0001,       // Zip64 extended information extra field
+    ZIP64_MAGIC32 = 0xffffffff, // a 32-bit field whose value is in there
+
     STORED = 0,
     DEFLATED = 8,
 
+    MAX_COMMENT_LEN = 65535,
+    MAX_ENTRIES = 1 << 24,      // sanity limit, far beyond what fits in RAM
+
+    EMPTY_SLOT = 0xffffffff,    // ZipIndexSlot.entry of an unused slot
+
     CENVEM_UNIX = 3 << 8,   // the high byte of CENVEM
 };
 
+static void freeSeekIndexes(ZipArchive* pArchive);
+
 
 /*
  * For debugging, dump the contents of a ZipEntry.
@@ -91,70 +122,228 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   hdr=%lld comp=%lld uncomp=%lld how=%d\n", pEntry->localHdrOffset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * Compute the hash code for a ZipEntry filename.
  *
- * Compare two ZipEntry structs, by name.
+ * This is MurmurHash3 (x86, 32-bit), which chews through the name four
+ * bytes at a time.  The seed is the name length, so names of different
+ * lengths are unlikely to collide even when they share a long prefix.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static unsigned int computeHash(const char* name, unsigned int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    uint32_t hash = nameLen;
+    uint32_t k;
+    unsigned int n = nameLen;
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+    while (n >= 4) {
+        memcpy(&k, name, 4);    // names aren't aligned
+        k *= c1;
+        k = ROTL32(k, 15);
+        k *= c2;
+        hash ^= k;
+        hash = ROTL32(hash, 13);
+        hash = hash * 5 + 0xe6546b64;
+        name += 4;
+        n -= 4;
+    }
+
+    k = 0;
+    switch (n) {
+    case 3: k ^= (unsigned char) name[2] << 16;     // fall through
+    case 2: k ^= (unsigned char) name[1] << 8;      // fall through
+    case 1: k ^= (unsigned char) name[0];
+            k *= c1;
+            k = ROTL32(k, 15);
+            k *= c2;
+            hash ^= k;
+    }
+#undef ROTL32
 
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    hash ^= nameLen;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * Find the slot for a name in the archive's name index: either the slot
+ * holding the entry with that name, or the empty slot where it would go.
  *
- * find a ZipEntry struct by name.
+ * The index is an open-addressed table with linear probing.  Each slot
+ * carries the hash and length of its entry's name, so a probe only has to
+ * go out to the ZipEntry (and compare names) when both of those match.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static ZipIndexSlot* findIndexSlot(const ZipArchive* pArchive,
+    const char* name, unsigned int nameLen, unsigned int hash)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    unsigned int i = hash & pArchive->indexMask;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    while (true) {
+        ZipIndexSlot* pSlot = &pArchive->pIndex[i];
+        if (pSlot->entry == EMPTY_SLOT) {
+            return pSlot;
+        }
+        if (pSlot->hash == hash && pSlot->nameLen == nameLen) {
+            const ZipEntry* pEntry = &pArchive->pEntries[pSlot->entry];
+            if (memcmp(pEntry->fileName, name, nameLen) == 0) {
+                return pSlot;
+            }
+        }
+        i = (i + 1) & pArchive->indexMask;
+    }
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
+ * Create the name index for all of the archive's entries.  The entries
+ * must be in their final places, since the index refers to them by
+ * position.
  *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * The table is at least twice as big as the number of entries, which
+ * keeps probe sequences short and guarantees an empty slot.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static bool buildNameIndex(ZipArchive* pArchive)
 {
-    unsigned int hash = 2;
+    unsigned int size, i;
+
+    size = 1;
+    while (size < pArchive->numEntries * 2) {
+        size <<= 1;
+    }
+    pArchive->pIndex = (ZipIndexSlot*) malloc(size * sizeof(ZipIndexSlot));
+    if (pArchive->pIndex == NULL) {
+        LOGE("Can't allocate %d-slot name index\n", size);
+        return false;
+    }
+    memset(pArchive->pIndex, 0xff, size * sizeof(ZipIndexSlot));
+    pArchive->indexMask = size - 1;
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        unsigned int hash = computeHash(pEntry->fileName, pEntry->fileNameLen);
+        ZipIndexSlot* pSlot = findIndexSlot(pArchive, pEntry->fileName,
+                pEntry->fileNameLen, hash);
 
-    return hash;
+        if (pSlot->entry != EMPTY_SLOT) {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+            continue;
+        }
+        pSlot->hash = hash;
+        pSlot->nameLen = pEntry->fileNameLen;
+        pSlot->entry = i;
+    }
+    return true;
+}
+
+/*
+ * (This is a qsort callback.)
+ *
+ * Order two ZipEntry structs by name, byte by byte, with a name sorting
+ * before any longer name that it is a prefix of.
+ *
+ * qsort() isn't stable, so entries with the same name are put in file
+ * order here: by local header offset, then by where the name sits in the
+ * central directory.  Otherwise which duplicate the name index keeps
+ * would depend on the libc.
+ */
+static int compareZipEntryNames(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned int minLen;
+    int diff;
+
+    minLen = entry1->fileNameLen;
+    if (entry2->fileNameLen < minLen) {
+        minLen = entry2->fileNameLen;
+    }
+    diff = memcmp(entry1->fileName, entry2->fileName, minLen);
+    if (diff == 0) {
+        diff = (int) entry1->fileNameLen - (int) entry2->fileNameLen;
+    }
+    if (diff == 0) {
+        if (entry1->localHdrOffset != entry2->localHdrOffset) {
+            diff = entry1->localHdrOffset < entry2->localHdrOffset ? -1 : 1;
+        } else if (entry1->fileName != entry2->fileName) {
+            diff = entry1->fileName < entry2->fileName ? -1 : 1;
+        }
+    }
+    return diff;
+}
+
+/*
+ * Compare the start of an entry's name against a prefix.  Returns zero if
+ * the name starts with the prefix, and otherwise orders the name relative
+ * to all names that do, consistently with compareZipEntryNames().
+ */
+static int comparePrefix(const ZipEntry* pEntry, const char* prefix,
+    unsigned int prefixLen)
+{
+    unsigned int minLen;
+    int diff;
+
+    minLen = pEntry->fileNameLen;
+    if (prefixLen < minLen) {
+        minLen = prefixLen;
+    }
+    diff = memcmp(pEntry->fileName, prefix, minLen);
+    if (diff == 0 && pEntry->fileNameLen < prefixLen) {
+        diff = -1;
+    }
+    return diff;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Find the range of entries [*pFirst, *pEnd) whose names start with
+ * "prefix".
+ *
+ * Since the entries are sorted, the sorted array doubles as an index of
+ * every directory in the archive: all the names under a prefix are
+ * contiguous, and two binary searches find where they start and end.
+ */
+static void findPrefixRange(const ZipArchive* pArchive, const char* prefix,
+    unsigned int prefixLen, unsigned int* pFirst, unsigned int* pEnd)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    unsigned int low, high;
+
+    /* First entry that doesn't sort before the prefix.
+     */
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *pFirst = low;
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    /* First entry after that which sorts after the prefix.
+     */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    *pEnd = low;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,18 +366,267 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Read "count" bytes of the archive file, starting at "offset", into "buf".
+ *
+ * This goes through pread() so that the file position of pArchive->fd is
+ * never used; callers keep their own cursor instead.  That is what allows
+ * several threads to stream entries out of the same archive at once.
+ *
+ * Archives opened from memory have no file, and are mapped whole.
+ */
+static const unsigned char* getMappedRange(const ZipArchive* pArchive,
+    long long offset, long long len);
+static bool readArchiveData(const ZipArchive* pArchive, long long offset,
+    unsigned char* buf, size_t count)
+{
+    if (pArchive->fd < 0) {
+        const unsigned char* data = getMappedRange(pArchive, offset, count);
+        if (data == NULL) {
+            LOGW("Read of %zu bytes at %lld is outside the archive\n",
+                count, offset);
+            return false;
+        }
+        memcpy(buf, data, count);
+        return true;
+    }
+    while (count > 0) {
+        ssize_t n = pread64(pArchive->fd, buf, count, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGW("pread of %zu bytes at %lld failed: %s\n",
+                count, offset, strerror(errno));
+            return false;
+        }
+        if (n == 0) {
+            LOGW("Unexpected EOF reading %zu bytes at %lld\n",
+                count, offset);
+            return false;
+        }
+        buf += n;
+        offset += n;
+        count -= n;
+    }
+    return true;
+}
+
+/*
+ * Return a pointer to [offset, offset+len) of the archive file if all of
+ * it is inside pArchive->map, or NULL if it isn't.
+ */
+static const unsigned char* getMappedRange(const ZipArchive* pArchive,
+    long long offset, long long len)
+{
+    const MemMapping* pMap = &pArchive->map;
+
+    if (pMap->addr == NULL || offset < pArchive->mapOffset || len < 0 ||
+        (unsigned long long)(offset - pArchive->mapOffset) > pMap->length ||
+        (unsigned long long)len >
+            pMap->length - (size_t)(offset - pArchive->mapOffset))
+    {
+        return NULL;
+    }
+    return (const unsigned char*)pMap->addr + (offset - pArchive->mapOffset);
+}
+
+/*
+ * Map [start, start+length) of the archive file.  mmap() can't reach
+ * past 2GB on 32-bit devices, so fall back to reading the range into
+ * anonymous memory when we have to.  Either way the result is released
+ * with sysReleaseShmem().
+ */
+static int mapArchiveSegment(const ZipArchive* pArchive, long long start,
+    size_t length, MemMapping* pMap)
+{
+    if (pArchive->fd < 0) {
+        return -1;
+    }
+    if ((off_t) start == start &&
+        sysMapFileSegmentInShmem(pArchive->fd, start, length, pMap) == 0)
+    {
+        return 0;
+    }
+    return sysLoadFileSegmentInShmem(pArchive->fd, start, length, pMap);
+}
+
+/*
+ * Get "count" bytes of the archive at "offset", from the mapping if
+ * they're in it, else by reading them into "buf".
+ */
+static const unsigned char* getArchiveBytes(const ZipArchive* pArchive,
+    long long offset, unsigned char* buf, size_t count)
+{
+    const unsigned char* ptr = getMappedRange(pArchive, offset, count);
+
+    if (ptr == NULL && readArchiveData(pArchive, offset, buf, count)) {
+        ptr = buf;
+    }
+    return ptr;
+}
+
+/*
+ * Find the EOCD.  We'll find it immediately unless they have a file
+ * comment, which can't be longer than 64K; don't go looking any
+ * further back than that.
+ *
+ * Returns NULL if there isn't one.
+ */
+static const unsigned char* findEndOfCentralDir(const MemMapping* pMap)
+{
+    const unsigned char* searchStart = pMap->addr;
+    const unsigned char* ptr;
+
+    if (pMap->length > ENDHDR + MAX_COMMENT_LEN) {
+        searchStart += pMap->length - (ENDHDR + MAX_COMMENT_LEN);
+    }
+    ptr = (const unsigned char*)pMap->addr + pMap->length - ENDHDR;
+
+    while (ptr >= searchStart) {
+        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
+            return ptr;
+        ptr--;
+    }
+    return NULL;
+}
+
+/*
+ * Where the central directory is, according to the EOCD record or, in
+ * a Zip64 archive, the Zip64 EOCD record.
+ */
+typedef struct {
+    const unsigned char* eocd;  // in pArchive->map
+    bool        zip64;
+    unsigned char eocd64[ZIP64_ENDHDR];   // copy of the Zip64 record
+    unsigned long long numEntries;
+    unsigned long long cdOffset;
+} CentralDirInfo;
+
+/*
+ * Find the central directory of the archive, whose end must be in
+ * pArchive->map.
+ *
+ * An archive that outgrows any of the EOCD fields has a Zip64 locator
+ * right before the EOCD, which points at a Zip64 EOCD record with the
+ * real, 64-bit values.  That record is usually right before the locator,
+ * but can be anywhere before it, so it's read rather than expected to be
+ * in the mapping.
+ */
+static bool findCentralDir(const ZipArchive* pArchive, CentralDirInfo* pInfo)
+{
+    const unsigned char* eocd;
+    const unsigned char* ptr;
+    unsigned char buf[ZIP64_LOCHDR];
+    long long eocdOffset;
+
+    eocd = findEndOfCentralDir(&pArchive->map);
+    if (eocd == NULL) {
+        LOGI("Could not find end-of-central-directory in Zip\n");
+        return false;
+    }
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->eocd = eocd;
+    pInfo->numEntries = get2LE(eocd + ENDSUB);
+    pInfo->cdOffset = get4LE(eocd + ENDOFF);
+
+    eocdOffset = pArchive->mapOffset +
+            (eocd - (const unsigned char*)pArchive->map.addr);
+    if (eocdOffset < ZIP64_LOCHDR) {
+        return true;
+    }
+    ptr = getArchiveBytes(pArchive, eocdOffset - ZIP64_LOCHDR,
+            buf, sizeof(buf));
+    if (ptr == NULL || get4LE(ptr) != ZIP64_LOCSIG) {
+        return true;
+    }
+
+    if (get8LE(ptr + ZIP64_LOCOFF) >
+            (unsigned long long)(eocdOffset - ZIP64_LOCHDR - ZIP64_ENDHDR))
+    {
+        LOGW("Bad offset to Zip64 end-of-central-directory\n");
+        return false;
+    }
+    ptr = getArchiveBytes(pArchive, get8LE(ptr + ZIP64_LOCOFF),
+            pInfo->eocd64, ZIP64_ENDHDR);
+    if (ptr == NULL || get4LE(ptr) != ZIP64_ENDSIG) {
+        LOGW("Missed the Zip64 end-of-central-directory sig\n");
+        return false;
+    }
+    if (ptr != pInfo->eocd64) {
+        memcpy(pInfo->eocd64, ptr, ZIP64_ENDHDR);
+    }
+    pInfo->zip64 = true;
+    pInfo->numEntries = get8LE(pInfo->eocd64 + ZIP64_ENDSUB);
+    pInfo->cdOffset = get8LE(pInfo->eocd64 + ZIP64_ENDOFF);
+    return true;
+}
+
+/*
+ * Fill in the central directory fields that were too small to hold their
+ * values, from the Zip64 extra field in "extra".  Only fields that are
+ * ZIP64_MAGIC32 in the central directory appear in the extra field, in
+ * this order.
+ *
+ * Returns false if there's no Zip64 extra field, or it's too short.
+ */
+static bool parseZip64Extra(const unsigned char* extra, unsigned int extraLen,
+    unsigned long long* pUncompLen, unsigned long long* pCompLen,
+    unsigned long long* pLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+
+        if (size > extraLen - 4) {
+            return false;
+        }
+        if (id == ZIP64_EXTID) {
+            unsigned long long* fields[3];
+            const unsigned char* ptr = extra + 4;
+            int i;
+
+            fields[0] = pUncompLen;
+            fields[1] = pCompLen;
+            fields[2] = pLocalHdrOffset;
+            for (i = 0; i < 3; i++) {
+                if (*fields[i] == ZIP64_MAGIC32) {
+                    if (ptr + 8 > extra + 4 + size) {
+                        return false;
+                    }
+                    *fields[i] = get8LE(ptr);
+                    ptr += 8;
+                }
+            }
+            return true;
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return false;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
  * store it in a hash table.
  *
+ * Only the central directory is read here.  The local file headers are
+ * scattered all over the archive, so they aren't looked at until the
+ * data of an entry is actually needed; see getEntryDataOffset().
+ *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool parseZipArchive(ZipArchive* pArchive)
 {
+    const MemMapping* pMap = &pArchive->map;
+    const unsigned char* mapEnd =
+            (const unsigned char*)pMap->addr + pMap->length;
+    CentralDirInfo cdInfo;
     bool result = false;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    unsigned char sig[4];
+    unsigned int i, numEntries;
     unsigned int val;
 
     /*
@@ -196,7 +634,11 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    ptr = getArchiveBytes(pArchive, 0, sig, sizeof(sig));
+    if (ptr == NULL) {
+        goto bail;
+    }
+    val = get4LE(ptr);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -205,54 +647,43 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         goto bail;
     }
 
-    /*
-     * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
-     */
-    ptr = pMap->addr + pMap->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pMap->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pMap->addr) {
-        LOGI("Could not find end-of-central-directory in Zip\n");
-        goto bail;
-    }
-
     /*
      * There are two interesting items in the EOCD block: the number of
      * entries in the file, and the file offset of the start of the
      * central directory.
      */
-    numEntries = get2LE(ptr + ENDSUB);
-    cdOffset = get4LE(ptr + ENDOFF);
+    if (!findCentralDir(pArchive, &cdInfo)) {
+        goto bail;
+    }
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    LOGVV("numEntries=%llu cdOffset=%llu zip64=%d\n",
+        cdInfo.numEntries, cdInfo.cdOffset, cdInfo.zip64);
+    if (cdInfo.numEntries == 0 || cdInfo.numEntries > MAX_ENTRIES ||
+        cdInfo.cdOffset >= (unsigned long long)pArchive->fileLength ||
+        getMappedRange(pArchive, cdInfo.cdOffset, 0) == NULL)
+    {
+        LOGW("Invalid entries=%llu offset=%llu (len=%lld)\n",
+            cdInfo.numEntries, cdInfo.cdOffset, pArchive->fileLength);
         goto bail;
     }
+    numEntries = cdInfo.numEntries;
 
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = getMappedRange(pArchive, cdInfo.cdOffset, 0);
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        unsigned long long localHdrOffset, compLen, uncompLen;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > mapEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -262,11 +693,13 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
 
         localHdrOffset = get4LE(ptr + CENOFF);
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
         fileNameLen = get2LE(ptr + CENNAM);
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if (fileName + fileNameLen + extraLen > (const char*)mapEnd) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,58 +708,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -334,8 +716,23 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
+        if ((localHdrOffset == ZIP64_MAGIC32 || compLen == ZIP64_MAGIC32 ||
+                uncompLen == ZIP64_MAGIC32) &&
+            !parseZip64Extra((const unsigned char*)fileName + fileNameLen,
+                extraLen, &uncompLen, &compLen, &localHdrOffset))
+        {
+            LOGW("Missing Zip64 extra field (at %d)\n", i);
+            goto bail;
+        }
+        if (compLen > (unsigned long long)pArchive->fileLength ||
+            uncompLen > (unsigned long long)LLONG_MAX)
+        {
+            LOGW("Bad entry sizes %llu/%llu (at %d)\n",
+                compLen, uncompLen, i);
+            goto bail;
+        }
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -352,128 +749,545 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
-            goto bail;
-        }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
-            goto bail;
-        }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
+        /* Don't touch the local header yet; just make sure that
+         * there's room for one where the central directory says.
+         */
+        if (localHdrOffset >= (unsigned long long)pArchive->fileLength ||
+            pArchive->fileLength - localHdrOffset < LOCHDR)
+        {
+            LOGW("Bad offset to local header: %llu (at %d)\n",
+                localHdrOffset, i);
             goto bail;
         }
-
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
+        pEntry->localHdrOffset = localHdrOffset;
 
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort the entries by name in one pass now that they've all been
+     * read.  findPrefixRange() depends on this.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
-#endif
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry),
+            compareZipEntryNames);
+
+    /* The name index has to wait until all entries are in their final
+     * places, since it refers to them by position.
+     */
+    if (!buildNameIndex(pArchive))
+        goto bail;
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pIndex);
+        pArchive->pIndex = NULL;
     }
     return result;
 }
 
 /*
- * Open a Zip archive and scan out the contents.
+ * Persistent index sidecar.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * Everything parseZipArchive() works out -- the sorted entry table and
+ * the name index -- only depends on the archive's bytes, so it can be
+ * saved to a file and used again the next time the same package is
+ * opened.  The file is keyed by the archive's size, its mtime and ctime
+ * to the nanosecond, and a hash of its EOCD record (which includes the
+ * central directory's offset and size, and the archive comment) and Zip64
+ * EOCD record, if any.  A copy that keeps the mtime still gets a new
+ * ctime, which nothing can set back.
  *
- * This will be called on non-Zip files, especially during startup, so
- * we don't want to be too noisy about failures.  (Do we want a "quiet"
- * flag?)
+ * The layout is native-endian and unpadded, since it never leaves the
+ * device that wrote it:
  *
- * On success, we fill out the contents of "pArchive".
+ *     ZipIndexHeader
+ *     ZipIndexRecord[numEntries]     in sorted order
+ *     ZipIndexSlot[numSlots]         the name index, used in place
+ *
+ * Loading checks that every offset in the file stays inside the archive
+ * and that the name index is well-formed, but otherwise trusts the
+ * contents, so the index must live somewhere that only recovery can
+ * write to.
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
-{
-    MemMapping map;
-    int err;
+#define ZIP_INDEX_MAGIC     0x58495a4d      // "MZIX"
+#define ZIP_INDEX_VERSION   3
 
-    LOGV("Opening archive '%s' %p\n", fileName, pArchive);
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t archiveSize;
+    int64_t  archiveMtime;
+    int64_t  archiveCtime;
+    uint32_t archiveMtimeNsec;
+    uint32_t archiveCtimeNsec;
+    uint32_t eocdHash;
+    uint32_t numEntries;
+    uint32_t numSlots;
+    uint32_t reserved;
+} ZipIndexHeader;
 
-    map.addr = NULL;
-    memset(pArchive, 0, sizeof(*pArchive));
+typedef struct {
+    uint64_t fileNameOffset;    // file offset, in the central directory
+    uint64_t localHdrOffset;
+    uint64_t compLen;
+    uint64_t uncompLen;
+    uint32_t fileNameLen;
+    uint32_t modTime;
+    uint32_t crc32;
+    uint32_t externalFileAttributes;
+    uint16_t compression;
+    uint16_t versionMadeBy;
+    uint32_t reserved;
+} ZipIndexRecord;
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
-        err = errno ? errno : -1;
-        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
-        goto bail;
-    }
+/*
+ * Fill out the key fields of an index header for the given archive.
+ */
+static bool makeZipIndexKey(const ZipArchive* pArchive,
+    ZipIndexHeader* pHeader)
+{
+    const MemMapping* pMap = &pArchive->map;
+    CentralDirInfo cdInfo;
+    struct stat st;
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
-        goto bail;
+    if (fstat(pArchive->fd, &st) != 0) {
+        return false;
     }
-
-    if (map.length < ENDHDR) {
-        err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
-        goto bail;
+    if (!findCentralDir(pArchive, &cdInfo)) {
+        return false;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
-        err = -1;
-        LOGV("Parsing '%s' failed\n", fileName);
-        goto bail;
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->magic = ZIP_INDEX_MAGIC;
+    pHeader->version = ZIP_INDEX_VERSION;
+    pHeader->archiveSize = st.st_size;
+    pHeader->archiveMtime = st.st_mtime;
+    pHeader->archiveMtimeNsec = SYS_STAT_MTIME_NSEC(&st);
+    pHeader->archiveCtime = st.st_ctime;
+    pHeader->archiveCtimeNsec = SYS_STAT_CTIME_NSEC(&st);
+    pHeader->eocdHash = computeHash((const char*) cdInfo.eocd,
+            (const unsigned char*)pMap->addr + pMap->length - cdInfo.eocd);
+    if (cdInfo.zip64) {
+        pHeader->eocdHash ^= computeHash((const char*) cdInfo.eocd64,
+                ZIP64_ENDHDR);
+    }
+    return true;
+}
+
+/*
+ * Try to set up "pArchive" from the index in "indexFileName".  Returns
+ * false, leaving the entries of "pArchive" alone, if there's no usable
+ * index for the archive.
+ */
+static bool loadZipIndex(ZipArchive* pArchive, const char* indexFileName)
+{
+    ZipIndexHeader key;
+    const ZipIndexHeader* pHeader;
+    const ZipIndexRecord* pRecords;
+    const ZipIndexSlot* pSlots;
+    ZipEntry* pEntries = NULL;
+    MemMapping indexMap;
+    unsigned int i, numEmpty = 0;
+    int fd;
+
+    if (!makeZipIndexKey(pArchive, &key)) {
+        return false;
+    }
+
+    fd = open(indexFileName, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (sysMapFileInShmem(fd, &indexMap) != 0) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    pHeader = (const ZipIndexHeader*) indexMap.addr;
+    if (indexMap.length < sizeof(ZipIndexHeader) ||
+        pHeader->magic != key.magic || pHeader->version != key.version ||
+        pHeader->archiveSize != key.archiveSize ||
+        pHeader->archiveMtime != key.archiveMtime ||
+        pHeader->archiveMtimeNsec != key.archiveMtimeNsec ||
+        pHeader->archiveCtime != key.archiveCtime ||
+        pHeader->archiveCtimeNsec != key.archiveCtimeNsec ||
+        pHeader->eocdHash != key.eocdHash)
+    {
+        LOGV("Index '%s' is stale\n", indexFileName);
+        goto bail;
+    }
+
+    /* The slot count has to be a power of two bigger than the number
+     * of entries, or lookups could run forever.  Bound both counts like
+     * a parsed directory first, so the size check below can't overflow.
+     */
+    if (pHeader->numEntries == 0 || pHeader->numEntries > MAX_ENTRIES ||
+        pHeader->numSlots > 2 * MAX_ENTRIES ||
+        pHeader->numSlots <= pHeader->numEntries ||
+        (pHeader->numSlots & (pHeader->numSlots - 1)) != 0 ||
+        indexMap.length != sizeof(ZipIndexHeader) +
+            (size_t)pHeader->numEntries * sizeof(ZipIndexRecord) +
+            (size_t)pHeader->numSlots * sizeof(ZipIndexSlot))
+    {
+        LOGW("Index '%s' is corrupt\n", indexFileName);
+        goto bail;
+    }
+    pRecords = (const ZipIndexRecord*) (pHeader + 1);
+    pSlots = (const ZipIndexSlot*) (pRecords + pHeader->numEntries);
+
+    pEntries = (ZipEntry*) calloc(pHeader->numEntries, sizeof(ZipEntry));
+    if (pEntries == NULL) {
+        goto bail;
+    }
+    for (i = 0; i < pHeader->numEntries; i++) {
+        const ZipIndexRecord* pRecord = &pRecords[i];
+        ZipEntry* pEntry = &pEntries[i];
+
+        pEntry->fileName = (const char*) getMappedRange(pArchive,
+                pRecord->fileNameOffset, pRecord->fileNameLen);
+        if (pEntry->fileName == NULL ||
+            pRecord->localHdrOffset >= (uint64_t)pArchive->fileLength ||
+            pArchive->fileLength - pRecord->localHdrOffset < LOCHDR ||
+            pRecord->compLen > (uint64_t)pArchive->fileLength ||
+            pRecord->uncompLen > (uint64_t)LLONG_MAX)
+        {
+            LOGW("Index '%s' is corrupt (at %d)\n", indexFileName, i);
+            goto bail;
+        }
+        pEntry->fileNameLen = pRecord->fileNameLen;
+        pEntry->localHdrOffset = pRecord->localHdrOffset;
+        pEntry->compLen = pRecord->compLen;
+        pEntry->uncompLen = pRecord->uncompLen;
+        pEntry->compression = pRecord->compression;
+        pEntry->modTime = pRecord->modTime;
+        pEntry->crc32 = pRecord->crc32;
+        pEntry->versionMadeBy = pRecord->versionMadeBy;
+        pEntry->externalFileAttributes = pRecord->externalFileAttributes;
+    }
+    for (i = 0; i < pHeader->numSlots; i++) {
+        if (pSlots[i].entry == EMPTY_SLOT) {
+            numEmpty++;
+        } else if (pSlots[i].entry >= pHeader->numEntries) {
+            LOGW("Index '%s' is corrupt (slot %d)\n", indexFileName, i);
+            goto bail;
+        }
+    }
+    if (numEmpty == 0) {
+        LOGW("Index '%s' is corrupt (no empty slots)\n", indexFileName);
+        goto bail;
+    }
+
+    pArchive->numEntries = pHeader->numEntries;
+    pArchive->pEntries = pEntries;
+    pArchive->pIndex = (ZipIndexSlot*) pSlots;
+    pArchive->indexMask = pHeader->numSlots - 1;
+    sysCopyMap(&pArchive->indexMap, &indexMap);
+    LOGV("Loaded index '%s' (%d entries)\n", indexFileName,
+        pHeader->numEntries);
+    return true;
+
+bail:
+    free(pEntries);
+    sysReleaseShmem(&indexMap);
+    return false;
+}
+
+/*
+ * Save the index of a freshly-parsed archive to "indexFileName".  The
+ * index is written to a temporary file and renamed into place, so a
+ * reader never sees a partial one.
+ */
+static bool writeZipIndex(const ZipArchive* pArchive,
+    const char* indexFileName)
+{
+    ZipIndexHeader header;
+    ZipIndexRecord* pRecords = NULL;
+    char* tmpName = NULL;
+    unsigned int i;
+    bool result = false;
+    int fd = -1;
+
+    if (!makeZipIndexKey(pArchive, &header)) {
+        return false;
+    }
+    header.numEntries = pArchive->numEntries;
+    header.numSlots = pArchive->indexMask + 1;
+
+    pRecords = (ZipIndexRecord*)
+            calloc(pArchive->numEntries, sizeof(ZipIndexRecord));
+    tmpName = (char*) malloc(strlen(indexFileName) + 5);
+    if (pRecords == NULL || tmpName == NULL) {
+        goto bail;
+    }
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        ZipIndexRecord* pRecord = &pRecords[i];
+
+        pRecord->fileNameOffset = pArchive->mapOffset +
+                (pEntry->fileName - (const char*)pArchive->map.addr);
+        pRecord->fileNameLen = pEntry->fileNameLen;
+        pRecord->localHdrOffset = pEntry->localHdrOffset;
+        pRecord->compLen = pEntry->compLen;
+        pRecord->uncompLen = pEntry->uncompLen;
+        pRecord->modTime = pEntry->modTime;
+        pRecord->crc32 = pEntry->crc32;
+        pRecord->externalFileAttributes = pEntry->externalFileAttributes;
+        pRecord->compression = pEntry->compression;
+        pRecord->versionMadeBy = pEntry->versionMadeBy;
+    }
+
+    strcpy(tmpName, indexFileName);
+    strcat(tmpName, ".tmp");
+    fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Can't create index '%s': %s\n", tmpName, strerror(errno));
+        goto bail;
+    }
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, pRecords, pArchive->numEntries * sizeof(ZipIndexRecord)) !=
+            (ssize_t)(pArchive->numEntries * sizeof(ZipIndexRecord)) ||
+        write(fd, pArchive->pIndex, header.numSlots * sizeof(ZipIndexSlot)) !=
+            (ssize_t)(header.numSlots * sizeof(ZipIndexSlot)))
+    {
+        LOGW("Can't write index '%s': %s\n", tmpName, strerror(errno));
+        goto bail;
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        goto bail;
+    }
+    fd = -1;
+    if (rename(tmpName, indexFileName) != 0) {
+        LOGW("Can't rename index to '%s': %s\n",
+            indexFileName, strerror(errno));
+        goto bail;
+    }
+    result = true;
+
+bail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!result && tmpName != NULL) {
+        unlink(tmpName);
+    }
+    free(tmpName);
+    free(pRecords);
+    return result;
+}
+
+/*
+ * Map the parts of the archive we keep around while it's open.
+ *
+ * Archives of up to MAX_WHOLE_MAP bytes are mapped in one piece, so that
+ * entry data can be used in place.  Bigger ones, or ones that can't be
+ * mapped whole because the address space is too fragmented, only get
+ * their central directory (and everything after it) mapped; entry data
+ * is then read or mapped a window at a time, so the address space we use
+ * doesn't grow with the size of the package.
+ */
+#define MAX_WHOLE_MAP (256 * 1024 * 1024)
+static bool mapArchive(ZipArchive* pArchive)
+{
+    CentralDirInfo cdInfo;
+    long long tailStart = 0;
+
+    if (pArchive->fileLength <= MAX_WHOLE_MAP &&
+        sysMapFileInShmem(pArchive->fd, &pArchive->map) == 0)
+    {
+        pArchive->mapOffset = 0;
+        return true;
+    }
+
+    /* Map the last 64K to find the EOCD, then extend the mapping back
+     * to the start of the central directory if it isn't in there.
+     */
+    if (pArchive->fileLength > ENDHDR + MAX_COMMENT_LEN) {
+        tailStart = pArchive->fileLength - (ENDHDR + MAX_COMMENT_LEN);
+    }
+    if (mapArchiveSegment(pArchive, tailStart,
+            pArchive->fileLength - tailStart, &pArchive->map) != 0)
+    {
+        return false;
+    }
+    pArchive->mapOffset = tailStart;
+
+    /* If the EOCD is missing or bogus, parseZipArchive() will say so.
+     */
+    if (findCentralDir(pArchive, &cdInfo) &&
+        cdInfo.cdOffset < (unsigned long long)tailStart)
+    {
+        unsigned long long length = pArchive->fileLength - cdInfo.cdOffset;
+        MemMapping map;
+
+        if ((size_t)length != length ||
+            mapArchiveSegment(pArchive, cdInfo.cdOffset, length, &map) != 0)
+        {
+            LOGW("Can't map %llu bytes of central directory\n", length);
+            return false;
+        }
+        sysReleaseShmem(&pArchive->map);
+        sysCopyMap(&pArchive->map, &map);
+        pArchive->mapOffset = cdInfo.cdOffset;
+    }
+    LOGV("Mapped %zd of %lld bytes of archive, from %lld\n",
+        pArchive->map.length, pArchive->fileLength, pArchive->mapOffset);
+    return true;
+}
+
+/*
+ * Open a Zip archive and scan out the contents.
+ *
+ * The easiest way to do this is to mmap() the whole thing and do the
+ * traditional backward scan for central directory.  Since the EOCD is
+ * a relatively small bit at the end, we should end up only touching a
+ * small set of pages.
+ *
+ * This will be called on non-Zip files, especially during startup, so
+ * we don't want to be too noisy about failures.  (Do we want a "quiet"
+ * flag?)
+ *
+ * On success, we fill out the contents of "pArchive".
+ */
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    return mzOpenZipArchiveWithIndex(fileName, NULL, pArchive);
+}
+
+/*
+ * Open a Zip archive, using or refreshing the index in "indexFileName".
+ */
+int mzOpenZipArchiveWithIndex(const char* fileName,
+        const char* indexFileName, ZipArchive* pArchive)
+{
+    int err;
+
+    LOGV("Opening archive '%s' %p\n", fileName, pArchive);
+
+    memset(pArchive, 0, sizeof(*pArchive));
+
+    pArchive->fd = open(fileName, O_RDONLY, 0);
+    if (pArchive->fd < 0) {
+        err = errno ? errno : -1;
+        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        goto bail;
+    }
+
+    pArchive->fileLength = lseek64(pArchive->fd, 0, SEEK_END);
+    if (pArchive->fileLength < ENDHDR) {
+        err = -1;
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            pArchive->fileLength);
+        goto bail;
+    }
+    lseek64(pArchive->fd, 0, SEEK_SET);
+
+    if (!mapArchive(pArchive)) {
+        err = -1;
+        LOGW("Map of '%s' failed\n", fileName);
+        goto bail;
+    }
+
+    if (indexFileName != NULL && loadZipIndex(pArchive, indexFileName)) {
+        /* Nothing left to parse. */
+    } else if (!parseZipArchive(pArchive)) {
+        err = -1;
+        LOGV("Parsing '%s' failed\n", fileName);
+        goto bail;
+    } else if (indexFileName != NULL) {
+        /* Not fatal; we'll just have to parse again next time. */
+        writeZipIndex(pArchive, indexFileName);
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
+/*
+ * Parse an archive that is already mapped whole, from memory.  Closes
+ * the archive on failure.
+ */
+static int openMappedArchive(ZipArchive* pArchive)
+{
+    pArchive->fd = -1;
+    pArchive->fileLength = pArchive->map.length;
+    pArchive->mapOffset = 0;
+
+    if (pArchive->fileLength < ENDHDR) {
+        LOGV("Archive at %p too small to be zip (%lld)\n",
+            pArchive->map.addr, pArchive->fileLength);
+        goto bail;
+    }
+    if (!parseZipArchive(pArchive)) {
+        LOGV("Parsing archive at %p failed\n", pArchive->map.addr);
+        goto bail;
+    }
+    return 0;
+
+bail:
+    mzCloseZipArchive(pArchive);
+    return -1;
+}
+
+/*
+ * Open an archive image that the caller keeps in memory.
+ */
+int mzOpenZipArchiveFromMemory(const void* addr, size_t length,
+        ZipArchive* pArchive)
+{
+    LOGV("Opening archive at %p (%zu bytes) %p\n", addr, length, pArchive);
+
+    /* No baseAddr, so mzCloseZipArchive() won't try to unmap it.
+     */
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->map.addr = (void*) addr;
+    pArchive->map.length = length;
+    return openMappedArchive(pArchive);
+}
+
+/*
+ * Open a STORED entry of "pParent" as an archive of its own.
+ */
+int mzOpenZipArchiveFromEntry(const ZipArchive* pParent,
+        const ZipEntry* pEntry, ZipArchive* pArchive)
+{
+    const unsigned char* data;
+    size_t length;
+    long long offset;
+
+    if (pEntry->compression != STORED) {
+        LOGW("Can't open compressed entry '%.*s' as an archive\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return -1;
+    }
+    if (mzGetZipEntryData(pParent, pEntry, &data, &length)) {
+        return mzOpenZipArchiveFromMemory(data, length, pArchive);
+    }
+
+    /* The parent is too big to be mapped whole; map just this entry,
+     * which the nested archive then owns.
+     */
+    memset(pArchive, 0, sizeof(*pArchive));
+    offset = mzGetZipEntryOffset(pParent, pEntry);
+    if (offset < 0 || (size_t)pEntry->compLen != pEntry->compLen ||
+        mapArchiveSegment(pParent, offset, pEntry->compLen,
+                &pArchive->map) != 0)
+    {
+        LOGW("Can't map entry '%.*s' as an archive\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        pArchive->fd = -1;
+        return -1;
+    }
+    return openMappedArchive(pArchive);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -488,325 +1302,2220 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     if (pArchive->map.addr != NULL)
         sysReleaseShmem(&pArchive->map);
 
-    free(pArchive->pEntries);
+    free(pArchive->pEntries);
+
+    /* A loaded index is used in place, inside its mapping.
+     */
+    if (pArchive->indexMap.addr != NULL) {
+        sysReleaseShmem(&pArchive->indexMap);
+        pArchive->indexMap.addr = NULL;
+    } else {
+        free(pArchive->pIndex);
+    }
+
+    freeSeekIndexes(pArchive);
+    pArchive->fd = -1;
+    pArchive->pIndex = NULL;
+    pArchive->pEntries = NULL;
+}
+
+/*
+ * Find a matching entry.
+ *
+ * Returns NULL if no matching entry found.
+ */
+const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
+        const char* entryName)
+{
+    return mzFindZipEntryN(pArchive, entryName, strlen(entryName));
+}
+
+/*
+ * Find an entry by a name that isn't NUL-terminated.
+ */
+const ZipEntry* mzFindZipEntryN(const ZipArchive* pArchive,
+        const char* entryName, unsigned int nameLen)
+{
+    const ZipIndexSlot* pSlot;
+
+    if (pArchive->pIndex == NULL) {
+        return NULL;
+    }
+    pSlot = findIndexSlot(pArchive, entryName, nameLen,
+            computeHash(entryName, nameLen));
+    if (pSlot->entry == EMPTY_SLOT) {
+        return NULL;
+    }
+    return &pArchive->pEntries[pSlot->entry];
+}
+
+/*
+ * Set up an iterator over all entries whose names start with "prefix".
+ */
+void mzZipEntryIterBegin(const ZipArchive* pArchive, const char* prefix,
+        ZipEntryIter* pIter)
+{
+    pIter->pArchive = pArchive;
+    findPrefixRange(pArchive, prefix, strlen(prefix),
+            &pIter->idx, &pIter->end);
+}
+
+/*
+ * Return true if the entry is a symbolic link.
+ */
+bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
+{
+    if ((pEntry->versionMadeBy & 0xff00) == CENVEM_UNIX) {
+        return S_ISLNK(pEntry->externalFileAttributes >> 16);
+    }
+    return false;
+}
+
+/*
+ * Find the file offset of an entry's data by reading its local header,
+ * which may have a different amount of "extra" data than the copy in
+ * the central directory.
+ *
+ * Returns false if the local header is bad or the data would run off
+ * the end of the archive.
+ */
+static bool getEntryDataOffset(const ZipArchive* pArchive,
+    const ZipEntry* pEntry, long long* pOffset)
+{
+    unsigned char buf[LOCHDR];
+    const unsigned char* localHdr;
+    long long offset;
+
+    /* parseZipArchive() made sure that the fixed part of the local
+     * header fits in the archive.
+     */
+    localHdr = getArchiveBytes(pArchive, pEntry->localHdrOffset,
+            buf, sizeof(buf));
+    if (localHdr == NULL) {
+        return false;
+    }
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    /* Both offsets are already known to be inside the file, so there's
+     * no overflow to worry about as long as we subtract.
+     */
+    offset = pEntry->localHdrOffset + LOCHDR
+        + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+    if (offset > pArchive->fileLength ||
+        pEntry->compLen > pArchive->fileLength - offset)
+    {
+        LOGW("Data ran off the end for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    *pOffset = offset;
+    return true;
+}
+
+/*
+ * Return the file offset of the entry's data, or -1 if the entry's
+ * local header is corrupt.
+ */
+long long mzGetZipEntryOffset(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    long long offset;
+
+    if (!getEntryDataOffset(pArchive, pEntry, &offset)) {
+        return -1;
+    }
+    return offset;
+}
+
+/*
+ * Get a pointer to the data of a STORED entry, straight out of the
+ * archive's memory mapping.
+ */
+bool mzGetZipEntryData(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        const unsigned char** pData, size_t* pLength)
+{
+    const unsigned char* data;
+    long long offset;
+
+    if (pEntry->compression != STORED) {
+        return false;
+    }
+    if (!getEntryDataOffset(pArchive, pEntry, &offset)) {
+        return false;
+    }
+    data = getMappedRange(pArchive, offset, pEntry->compLen);
+    if (data == NULL) {
+        return false;
+    }
+
+    *pData = data;
+    *pLength = pEntry->compLen;
+    return true;
+}
+
+/*
+ * Tell the kernel that we are about to read [offset, offset+len) of the
+ * archive front to back.  Small ranges aren't worth the system calls;
+ * readahead already covers them.
+ */
+#define ADVISE_MIN (64 * 1024)
+static void adviseArchiveRange(const ZipArchive* pArchive, long long offset,
+    long long len)
+{
+    const unsigned char* data;
+
+    if (len < ADVISE_MIN) {
+        return;
+    }
+    if (pArchive->fd >= 0 && (off_t) offset == offset && (off_t) len == len) {
+        posix_fadvise(pArchive->fd, offset, len, POSIX_FADV_SEQUENTIAL);
+    }
+    data = getMappedRange(pArchive, offset, len);
+    if (data != NULL) {
+        uintptr_t start = (uintptr_t)data;
+        uintptr_t pageMask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+        uintptr_t aligned = start & ~pageMask;
+
+        madvise((void*)aligned, len + (start - aligned), MADV_WILLNEED);
+    }
+}
+
+/*
+ * Walks a range of the archive a piece at a time, for code that wants
+ * the data in memory.  If the range is inside the archive mapping it is
+ * handed out in one piece; otherwise each piece is a window of at most
+ * DATA_WINDOW_SIZE bytes, mapped just for as long as it's being used.
+ *
+ * Use like this:
+ *   DataCursor cursor;
+ *   dataCursorInit(&cursor, pArchive, offset, len);
+ *   while ((data = dataCursorNext(&cursor, &dataLen)) != NULL) {
+ *       ...
+ *   }
+ *   ok = (cursor.remaining == 0);
+ *   dataCursorEnd(&cursor);
+ */
+#define DATA_WINDOW_SIZE (8 * 1024 * 1024)
+typedef struct {
+    const ZipArchive* pArchive;
+    long long   offset;         // file offset of the next piece
+    long long   remaining;      // bytes not handed out yet
+    MemMapping  window;         // the current piece, if we mapped it
+} DataCursor;
+
+static void dataCursorInit(DataCursor* pCursor, const ZipArchive* pArchive,
+    long long offset, long long len)
+{
+    memset(pCursor, 0, sizeof(*pCursor));
+    pCursor->pArchive = pArchive;
+    pCursor->offset = offset;
+    pCursor->remaining = len;
+}
+
+static void dataCursorEnd(DataCursor* pCursor)
+{
+    if (pCursor->window.addr != NULL) {
+        sysReleaseShmem(&pCursor->window);
+        pCursor->window.addr = NULL;
+    }
+}
+
+/*
+ * Return the next piece of the range and set "*pLen" to its length,
+ * releasing the previous piece.  Returns NULL at the end of the range,
+ * or if the next piece can't be mapped; "remaining" tells them apart.
+ */
+static const unsigned char* dataCursorNext(DataCursor* pCursor, size_t* pLen)
+{
+    const unsigned char* data;
+    long long len = pCursor->remaining;
+
+    dataCursorEnd(pCursor);
+    if (len == 0) {
+        return NULL;
+    }
+    data = getMappedRange(pCursor->pArchive, pCursor->offset, len);
+    if (data == NULL) {
+        if (len > DATA_WINDOW_SIZE) {
+            len = DATA_WINDOW_SIZE;
+        }
+        if (mapArchiveSegment(pCursor->pArchive, pCursor->offset, len,
+                &pCursor->window) != 0)
+        {
+            return NULL;
+        }
+        data = pCursor->window.addr;
+    }
+    pCursor->offset += len;
+    pCursor->remaining -= len;
+    *pLen = len;
+    return data;
+}
+
+/* Call processFunction on [offset, offset+len) of the archive file.
+ *
+ * The data is handed over directly from the archive mapping, in slices
+ * of at most STORED_SLICE_SIZE bytes so that callers tracking progress
+ * still get called back at a reasonable rate.
+ */
+#define STORED_SLICE_SIZE (1024 * 1024)
+static bool processArchiveRange(const ZipArchive *pArchive, long long offset,
+    long long len, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    DataCursor cursor;
+    const unsigned char* data;
+    size_t bytesLeft;
+    bool ret = true;
+
+    adviseArchiveRange(pArchive, offset, len);
+
+    dataCursorInit(&cursor, pArchive, offset, len);
+    while (ret && (data = dataCursorNext(&cursor, &bytesLeft)) != NULL) {
+        while (bytesLeft > 0) {
+            size_t count = bytesLeft;
+            if (count > STORED_SLICE_SIZE) {
+                count = STORED_SLICE_SIZE;
+            }
+            if (!processFunction(data, count, cookie)) {
+                ret = false;
+                break;
+            }
+            data += count;
+            bytesLeft -= count;
+        }
+    }
+    if (cursor.remaining != 0) {
+        ret = false;
+    }
+    dataCursorEnd(&cursor);
+    return ret;
+}
+
+/* Call processFunction on the uncompressed data of a STORED entry.
+ */
+static bool processStoredEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    long long offset;
+
+    if (!getEntryDataOffset(pArchive, pEntry, &offset)) {
+        return false;
+    }
+    return processArchiveRange(pArchive, offset, pEntry->compLen,
+            processFunction, cookie);
+}
+
+/*
+ * Read-ahead for the compressed data of large entries.
+ *
+ * A reader thread pread()s the entry into a ring of PREFETCH_BUFS buffers
+ * while the caller inflates the buffer it was handed last, so that the
+ * card is busy while we are burning CPU and vice versa.  Entries smaller
+ * than PREFETCH_MIN are read synchronously; the thread isn't worth it.
+ */
+#define PREFETCH_MIN        (1024 * 1024)
+#define PREFETCH_BUFS       4
+#define PREFETCH_BUF_SIZE   (128 * 1024)
+
+typedef struct {
+    const ZipArchive* pArchive;
+    long long   readOffset;     // next archive offset the reader fetches
+    long long   remaining;      // compressed bytes not yet fetched
+    unsigned char* bufs[PREFETCH_BUFS];
+    size_t      lens[PREFETCH_BUFS];
+    unsigned int first;         // oldest filled buffer
+    unsigned int filled;        // buffers filled and not yet released
+    bool        holding;        // consumer is using bufs[first]
+    bool        finished;       // reader has exited
+    bool        failed;         // reader hit an I/O error
+    bool        stop;           // consumer wants the reader gone
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t   thread;
+} Prefetcher;
+
+static void* prefetchThread(void* arg)
+{
+    Prefetcher* pf = (Prefetcher*) arg;
+
+    pthread_mutex_lock(&pf->lock);
+    while (pf->remaining > 0 && !pf->stop) {
+        unsigned int slot;
+        size_t count;
+        bool ok;
+
+        while (pf->filled == PREFETCH_BUFS && !pf->stop) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+        if (pf->stop) {
+            break;
+        }
+        slot = (pf->first + pf->filled) % PREFETCH_BUFS;
+        count = pf->remaining > PREFETCH_BUF_SIZE ?
+                PREFETCH_BUF_SIZE : (size_t) pf->remaining;
+        pthread_mutex_unlock(&pf->lock);
+
+        ok = readArchiveData(pf->pArchive, pf->readOffset, pf->bufs[slot],
+                count);
+
+        pthread_mutex_lock(&pf->lock);
+        if (!ok) {
+            pf->failed = true;
+            break;
+        }
+        pf->readOffset += count;
+        pf->remaining -= count;
+        pf->lens[slot] = count;
+        pf->filled++;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pf->finished = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/*
+ * Start reading "len" bytes at "offset" in the background.  Returns false
+ * if the reader couldn't be set up, in which case the caller should read
+ * synchronously instead.
+ */
+static bool prefetchStart(Prefetcher* pf, const ZipArchive* pArchive,
+    long long offset, long long len)
+{
+    unsigned char* mem;
+    int i;
+
+    memset(pf, 0, sizeof(*pf));
+    mem = (unsigned char*) malloc(PREFETCH_BUFS * PREFETCH_BUF_SIZE);
+    if (mem == NULL) {
+        return false;
+    }
+    for (i = 0; i < PREFETCH_BUFS; i++) {
+        pf->bufs[i] = mem + i * PREFETCH_BUF_SIZE;
+    }
+    pf->pArchive = pArchive;
+    pf->readOffset = offset;
+    pf->remaining = len;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetchThread, pf) != 0) {
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->lock);
+        free(mem);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Release the buffer returned by the previous call, and wait for the next
+ * one.  Returns NULL on a read error or if the entry has been used up.
+ */
+static const unsigned char* prefetchNext(Prefetcher* pf, size_t* pLen)
+{
+    const unsigned char* data = NULL;
+
+    pthread_mutex_lock(&pf->lock);
+    if (pf->holding) {
+        pf->first = (pf->first + 1) % PREFETCH_BUFS;
+        pf->filled--;
+        pf->holding = false;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    while (pf->filled == 0 && !pf->finished) {
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    }
+    if (pf->filled > 0) {
+        data = pf->bufs[pf->first];
+        *pLen = pf->lens[pf->first];
+        pf->holding = true;
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return data;
+}
+
+static void prefetchFinish(Prefetcher* pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    pthread_join(pf->thread, NULL);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf->bufs[0]);
+}
+
+/*
+ * Call processFunction on the uncompressed data of an entry compressed
+ * with any supported method.
+ */
+static bool processCompressedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const Decompressor *pDecomp,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    long long result = -1;
+    long long totalOut = 0;
+    unsigned char readBuf[32 * 1024];
+    unsigned char procBuf[32 * 1024];
+    const unsigned char* in = NULL;
+    size_t inLen = 0;
+    unsigned char* out = procBuf;
+    size_t outLen = sizeof(procBuf);
+    void* state;
+    int status;
+    long long compRemaining;
+    long long readOffset;
+    Prefetcher prefetcher;
+    bool prefetching = false;
+
+    compRemaining = pEntry->compLen;
+    if (!getEntryDataOffset(pArchive, pEntry, &readOffset)) {
+        goto bail;
+    }
+    adviseArchiveRange(pArchive, readOffset, compRemaining);
+
+    state = pDecomp->begin();
+    if (state == NULL) {
+        goto bail;
+    }
+
+    if (compRemaining >= PREFETCH_MIN) {
+        prefetching = prefetchStart(&prefetcher, pArchive, readOffset,
+                compRemaining);
+    }
+
+    /*
+     * Loop while we have data.
+     */
+    do {
+        /* read as much as we can */
+        if (inLen == 0 && prefetching) {
+            in = prefetchNext(&prefetcher, &inLen);
+            if (in == NULL) {
+                LOGW("%s read failed (prefetch)\n", pDecomp->name);
+                goto z_bail;
+            }
+        } else if (inLen == 0) {
+            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
+                        (long)sizeof(readBuf) : (long)compRemaining;
+            LOGVV("+++ reading %ld bytes (%lld left)\n",
+                getSize, compRemaining);
+
+            if (!readArchiveData(pArchive, readOffset, readBuf, getSize)) {
+                LOGW("%s read failed (%ld bytes at %lld)\n",
+                    pDecomp->name, getSize, readOffset);
+                goto z_bail;
+            }
+
+            readOffset += getSize;
+            compRemaining -= getSize;
+
+            in = readBuf;
+            inLen = getSize;
+        }
+
+        /* uncompress the data */
+        status = pDecomp->run(state, &in, &inLen, &out, &outLen);
+        if (status == DECOMP_ERROR) {
+            goto z_bail;
+        }
+
+        /* write when we're full or when we're done */
+        if (outLen == 0 || (status == DECOMP_END && out != procBuf)) {
+            long procSize = out - procBuf;
+            LOGVV("+++ processing %d bytes\n", (int) procSize);
+            bool ret = processFunction(procBuf, procSize, cookie);
+            if (!ret) {
+                LOGW("Process function elected to fail (in %s)\n",
+                    pDecomp->name);
+                goto z_bail;
+            }
+            totalOut += procSize;
+
+            out = procBuf;
+            outLen = sizeof(procBuf);
+        }
+    } while (status == DECOMP_OK);
+
+    // success!  (We count the output ourselves; zlib's total_out is only
+    // 32 bits on some devices.)
+    result = totalOut;
+
+z_bail:
+    if (prefetching) {
+        prefetchFinish(&prefetcher);
+    }
+    pDecomp->end(state);        /* free up any allocated structures */
+
+bail:
+    if (result != pEntry->uncompLen) {
+        if (result != -1)        // error already shown?
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+                result, pEntry->uncompLen);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Decompress an entry in one shot, straight from the archive mapping into
+ * "buf", which must have room for pEntry->uncompLen bytes.
+ *
+ * This skips the intermediate buffer and the per-32K processing calls of
+ * processCompressedEntry(), for callers that want the whole entry anyway,
+ * and lets the decompressor use its whole-buffer decoder.  (If the
+ * archive isn't mapped whole, the input comes in a few windows rather
+ * than all at once, but the output still goes straight to "buf".)
+ */
+static bool decompressEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buf)
+{
+    const Decompressor* pDecomp = mzFindDecompressor(pEntry->compression);
+    const unsigned char* data;
+    DataCursor cursor;
+    long long offset;
+    unsigned char* out = buf;
+    size_t outLen;
+    void* state;
+    int status = DECOMP_OK;
+
+    if (pDecomp == NULL) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if ((size_t)pEntry->uncompLen != pEntry->uncompLen) {
+        LOGE("Entry '%.*s' is too big to decompress in one shot\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    outLen = pEntry->uncompLen;
+    if (!getEntryDataOffset(pArchive, pEntry, &offset)) {
+        return false;
+    }
+
+    adviseArchiveRange(pArchive, offset, pEntry->compLen);
+
+    data = getMappedRange(pArchive, offset, pEntry->compLen);
+    if (data != NULL) {
+        return pDecomp->decodeAll(data, pEntry->compLen, buf, outLen);
+    }
+
+    state = pDecomp->begin();
+    if (state == NULL) {
+        return false;
+    }
+    dataCursorInit(&cursor, pArchive, offset, pEntry->compLen);
+    while (status == DECOMP_OK) {
+        size_t len;
+        data = dataCursorNext(&cursor, &len);
+        if (data == NULL) {
+            status = DECOMP_ERROR;
+            break;
+        }
+        while (len > 0 && status == DECOMP_OK) {
+            status = pDecomp->run(state, &data, &len, &out, &outLen);
+        }
+    }
+    dataCursorEnd(&cursor);
+    pDecomp->end(state);
+
+    if (status != DECOMP_END) {
+        LOGD("%s failed on entry '%.*s'\n", pDecomp->name,
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if (outLen != 0) {
+        LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+            pEntry->uncompLen - (long long)outLen, pEntry->uncompLen);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Stream the uncompressed data through the supplied function,
+ * passing cookie to it each time it gets called.  processFunction
+ * may be called more than once.
+ *
+ * If processFunction returns false, the operation is abandoned and
+ * mzProcessZipEntryContents() immediately returns false.
+ *
+ * This is useful for calculating the hash of an entry's uncompressed contents.
+ */
+bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    const Decompressor* pDecomp;
+
+    if (pEntry->compression == STORED) {
+        return processStoredEntry(pArchive, pEntry, processFunction, cookie);
+    }
+    pDecomp = mzFindDecompressor(pEntry->compression);
+    if (pDecomp == NULL) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    return processCompressedEntry(pArchive, pEntry, pDecomp,
+            processFunction, cookie);
+}
+
+/*
+ * Is [offset, offset+len) inside the archive file?
+ */
+static bool isArchiveRange(const ZipArchive* pArchive, long long offset,
+    long long len)
+{
+    return offset >= 0 && len >= 0 && offset <= pArchive->fileLength &&
+        len <= pArchive->fileLength - offset;
+}
+
+/*
+ * Call processFunction on raw bytes of the archive file.
+ */
+bool mzProcessZipArchiveRange(const ZipArchive* pArchive, long long offset,
+    long long len, ProcessZipEntryContentsFunction processFunction,
+    void* cookie)
+{
+    if (!isArchiveRange(pArchive, offset, len)) {
+        LOGW("Range of %lld bytes at %lld is outside the archive\n",
+            len, offset);
+        return false;
+    }
+    return processArchiveRange(pArchive, offset, len, processFunction,
+            cookie);
+}
+
+/*
+ * Copy raw bytes of the archive file into "buf".
+ */
+bool mzReadZipArchiveRange(const ZipArchive* pArchive, long long offset,
+    void* buf, size_t count)
+{
+    if (!isArchiveRange(pArchive, offset, count)) {
+        LOGW("Read of %zu bytes at %lld is outside the archive\n",
+            count, offset);
+        return false;
+    }
+    return readArchiveData(pArchive, offset, (unsigned char*) buf, count);
+}
+
+/*
+ * Get the file offset of the central directory.
+ */
+bool mzGetZipArchiveDirectoryOffset(const ZipArchive* pArchive,
+    long long* pOffset)
+{
+    CentralDirInfo cdInfo;
+
+    if (!findCentralDir(pArchive, &cdInfo) ||
+        cdInfo.cdOffset > (unsigned long long)pArchive->fileLength)
+    {
+        return false;
+    }
+    *pOffset = cdInfo.cdOffset;
+    return true;
+}
+
+static bool crcProcessFunction(const unsigned char *data, int dataLen,
+        void *crc)
+{
+    *(unsigned long *)crc = mzCrc32(*(unsigned long *)crc, data, dataLen);
+    return true;
+}
+
+/*
+ * Check the CRC on this entry; return true if it is correct.
+ * May do other internal checks as well.
+ */
+bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
+{
+    unsigned long crc;
+    bool ret;
+
+    crc = 0;
+    ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
+            (void *)&crc);
+    if (!ret) {
+        LOGE("Can't calculate CRC for entry\n");
+        return false;
+    }
+    if (crc != (unsigned long)pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    char *buf;
+    int bufLen;
+} CopyProcessArgs;
+
+static bool copyProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
+    if (dataLen <= args->bufLen) {
+        memcpy(args->buf, data, dataLen);
+        args->buf += dataLen;
+        args->bufLen -= dataLen;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Read an entry into a buffer allocated by the caller.
+ */
+bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        char *buf, int bufLen)
+{
+    CopyProcessArgs args;
+    bool ret;
+
+    /* If the whole entry fits, decompress it right where it's going.
+     */
+    if (pEntry->compression != STORED && pEntry->uncompLen <= bufLen) {
+        if (!decompressEntryToBuffer(pArchive, pEntry, (unsigned char *)buf)) {
+            LOGE("Can't extract entry to buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
+    args.buf = buf;
+    args.bufLen = bufLen;
+    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
+            (void *)&args);
+    if (!ret) {
+        LOGE("Can't extract entry to buffer.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Seek indexes.
+ *
+ * Inflate can be restarted at any deflate block boundary, given the bit
+ * position of the block and the 32K of output that precede it (the most
+ * a back-reference can reach).  A seek index records such checkpoints
+ * every "span" bytes of output, so that reading a range out of the middle
+ * of a large entry only has to inflate from the nearest checkpoint.
+ *
+ * This is the technique of zlib's examples/zran.c.
+ */
+#define SEEK_WINDOW_SIZE    (32 * 1024)
+#define SEEK_SPAN_MIN       SEEK_WINDOW_SIZE
+
+typedef struct {
+    long long   uncompOffset;   // offset of the checkpoint in the output
+    long long   compOffset;     // first whole byte of the block, in the data
+    int         bits;           // bits of the block in the byte before that
+    unsigned int windowLen;     // bytes of output before the checkpoint
+    unsigned char window[SEEK_WINDOW_SIZE];
+} ZipSeekPoint;
+
+struct ZipSeekIndex {
+    const ZipEntry* pEntry;
+    long        span;
+    unsigned int numPoints;
+    unsigned int pointsCap;
+    ZipSeekPoint* points;
+    struct ZipSeekIndex* next;  // next index attached to the same archive
+};
+
+/*
+ * Record a checkpoint at the current position of "pStream", which has
+ * consumed "totalIn" bytes and produced "totalOut".  (We count those
+ * ourselves; the stream's totals are only 32 bits on some devices.)
+ * "window" is the circular output buffer the stream is inflating into.
+ */
+static bool addSeekPoint(ZipSeekIndex* pIndex, const z_stream* pStream,
+    const unsigned char* window, long long totalIn, long long totalOut)
+{
+    ZipSeekPoint* pPoint;
+    size_t pos = pStream->next_out - window;
+
+    if (pIndex->numPoints == pIndex->pointsCap) {
+        unsigned int newCap = pIndex->pointsCap ? pIndex->pointsCap * 2 : 8;
+        ZipSeekPoint* newPoints = (ZipSeekPoint*)
+                realloc(pIndex->points, newCap * sizeof(ZipSeekPoint));
+        if (newPoints == NULL) {
+            return false;
+        }
+        pIndex->points = newPoints;
+        pIndex->pointsCap = newCap;
+    }
+    pPoint = &pIndex->points[pIndex->numPoints++];
+    pPoint->uncompOffset = totalOut;
+    pPoint->compOffset = totalIn;
+    pPoint->bits = pStream->data_type & 7;
+
+    /* Unroll the circular window, oldest byte first.
+     */
+    if (totalOut >= SEEK_WINDOW_SIZE) {
+        memcpy(pPoint->window, window + pos, SEEK_WINDOW_SIZE - pos);
+        memcpy(pPoint->window + SEEK_WINDOW_SIZE - pos, window, pos);
+        pPoint->windowLen = SEEK_WINDOW_SIZE;
+    } else {
+        memcpy(pPoint->window, window, pos);
+        pPoint->windowLen = pos;
+    }
+    return true;
+}
+
+/*
+ * Inflate a DEFLATED entry from start to finish, building a seek index
+ * as we go.
+ */
+ZipSeekIndex* mzBuildZipSeekIndex(const ZipArchive* pArchive,
+    const ZipEntry* pEntry, long span,
+    ProcessZipEntryContentsFunction processFunction, void* cookie)
+{
+    unsigned char window[SEEK_WINDOW_SIZE];
+    ZipSeekIndex* pIndex = NULL;
+    DataCursor cursor;
+    z_stream zstream;
+    long long totalIn = 0;
+    long long totalOut = 0;
+    long long last = 0;
+    long long offset;
+    int zerr;
+    bool ok = false;
+
+    if (pEntry->compression != DEFLATED) {
+        LOGW("Can't index entry '%.*s' (compression %d)\n",
+            pEntry->fileNameLen, pEntry->fileName, pEntry->compression);
+        return NULL;
+    }
+    if (!getEntryDataOffset(pArchive, pEntry, &offset)) {
+        return NULL;
+    }
+    adviseArchiveRange(pArchive, offset, pEntry->compLen);
+
+    pIndex = (ZipSeekIndex*) calloc(1, sizeof(ZipSeekIndex));
+    if (pIndex == NULL) {
+        return NULL;
+    }
+    pIndex->pEntry = pEntry;
+    pIndex->span = span < SEEK_SPAN_MIN ? SEEK_SPAN_MIN : span;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.data_type = Z_UNKNOWN;
+
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        free(pIndex);
+        return NULL;
+    }
+    dataCursorInit(&cursor, pArchive, offset, pEntry->compLen);
+
+    /* Inflate one block at a time, so that we get to look at every block
+     * boundary.  Bit 7 of data_type is set at the end of a block, and bit
+     * 6 if that was the last one; there's nothing to resume after that.
+     */
+    do {
+        unsigned char* outStart;
+        uInt inBefore;
+
+        /* Once the input is used up, inflate may still have the last
+         * few codes buffered; let it run dry before complaining.
+         */
+        if (zstream.avail_in == 0 && cursor.remaining > 0) {
+            size_t len;
+            const unsigned char* data = dataCursorNext(&cursor, &len);
+            if (data == NULL) {
+                LOGW("Can't map data indexing '%.*s'\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+                goto bail;
+            }
+            zstream.next_in = (Bytef*) data;
+            zstream.avail_in = len;
+        }
+        if (zstream.avail_out == 0) {
+            zstream.next_out = window;
+            zstream.avail_out = sizeof(window);
+        }
+        outStart = zstream.next_out;
+        inBefore = zstream.avail_in;
+        zerr = inflate(&zstream, Z_BLOCK);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            goto bail;
+        }
+        totalIn += inBefore - zstream.avail_in;
+        totalOut += zstream.next_out - outStart;
+        if (processFunction != NULL && zstream.next_out != outStart &&
+            !processFunction(outStart, zstream.next_out - outStart, cookie))
+        {
+            LOGW("Process function elected to fail (in index)\n");
+            goto bail;
+        }
+        if (zerr == Z_OK && (zstream.data_type & 128) &&
+            !(zstream.data_type & 64) &&
+            totalOut - last >= pIndex->span)
+        {
+            if (!addSeekPoint(pIndex, &zstream, window, totalIn, totalOut)) {
+                LOGE("Out of memory building seek index\n");
+                goto bail;
+            }
+            last = totalOut;
+        }
+    } while (zerr != Z_STREAM_END);
+
+    if (totalOut != pEntry->uncompLen) {
+        LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+            totalOut, pEntry->uncompLen);
+        goto bail;
+    }
+    LOGV("Indexed '%.*s': %d checkpoints\n",
+        pEntry->fileNameLen, pEntry->fileName, pIndex->numPoints);
+    ok = true;
+
+bail:
+    dataCursorEnd(&cursor);
+    inflateEnd(&zstream);
+    if (!ok) {
+        mzFreeZipSeekIndex(pIndex);
+        pIndex = NULL;
+    }
+    return pIndex;
+}
+
+void mzFreeZipSeekIndex(ZipSeekIndex* pIndex)
+{
+    if (pIndex != NULL) {
+        free(pIndex->points);
+        free(pIndex);
+    }
+}
+
+/*
+ * Seek index file format (native byte order):
+ *
+ *     ZipSeekIndexHeader
+ *     ZipSeekIndexRecord[numPoints]  each followed by SEEK_WINDOW_SIZE
+ *                                    bytes of window
+ *
+ * The header repeats enough of the entry's central directory record to
+ * tell whether the file belongs to it.  The windows themselves can't be
+ * checked, so the file must live somewhere only recovery can write to.
+ */
+#define ZIP_SEEK_INDEX_MAGIC    0x58535a4d      // "MZSX"
+#define ZIP_SEEK_INDEX_VERSION  2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t localHdrOffset;
+    uint64_t compLen;
+    uint64_t uncompLen;
+    uint32_t crc32;
+    uint32_t span;
+    uint32_t numPoints;
+    uint32_t reserved;
+} ZipSeekIndexHeader;
+
+typedef struct {
+    uint64_t uncompOffset;
+    uint64_t compOffset;
+    uint32_t bits;
+    uint32_t windowLen;
+} ZipSeekIndexRecord;
+
+static void makeSeekIndexKey(const ZipEntry* pEntry,
+    ZipSeekIndexHeader* pHeader)
+{
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->magic = ZIP_SEEK_INDEX_MAGIC;
+    pHeader->version = ZIP_SEEK_INDEX_VERSION;
+    pHeader->localHdrOffset = pEntry->localHdrOffset;
+    pHeader->compLen = pEntry->compLen;
+    pHeader->uncompLen = pEntry->uncompLen;
+    pHeader->crc32 = pEntry->crc32;
+}
+
+/*
+ * Save a seek index to "fileName", via a temporary file.
+ */
+bool mzWriteZipSeekIndex(const ZipSeekIndex* pIndex, const char* fileName)
+{
+    ZipSeekIndexHeader header;
+    char* tmpName;
+    unsigned int i;
+    bool result = false;
+    int fd;
+
+    makeSeekIndexKey(pIndex->pEntry, &header);
+    header.span = pIndex->span;
+    header.numPoints = pIndex->numPoints;
+
+    tmpName = (char*) malloc(strlen(fileName) + 5);
+    if (tmpName == NULL) {
+        return false;
+    }
+    strcpy(tmpName, fileName);
+    strcat(tmpName, ".tmp");
+    fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Can't create seek index '%s': %s\n", tmpName, strerror(errno));
+        goto bail;
+    }
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        goto write_bail;
+    }
+    for (i = 0; i < pIndex->numPoints; i++) {
+        const ZipSeekPoint* pPoint = &pIndex->points[i];
+        ZipSeekIndexRecord record;
+
+        record.uncompOffset = pPoint->uncompOffset;
+        record.compOffset = pPoint->compOffset;
+        record.bits = pPoint->bits;
+        record.windowLen = pPoint->windowLen;
+        if (write(fd, &record, sizeof(record)) != sizeof(record) ||
+            write(fd, pPoint->window, SEEK_WINDOW_SIZE) != SEEK_WINDOW_SIZE)
+        {
+            goto write_bail;
+        }
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        goto write_bail;
+    }
+    fd = -1;
+    if (rename(tmpName, fileName) != 0) {
+        LOGW("Can't rename seek index to '%s': %s\n",
+            fileName, strerror(errno));
+        goto bail;
+    }
+    result = true;
+    goto bail;
+
+write_bail:
+    LOGW("Can't write seek index '%s': %s\n", tmpName, strerror(errno));
+bail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!result) {
+        unlink(tmpName);
+    }
+    free(tmpName);
+    return result;
+}
+
+/*
+ * Load the seek index for "pEntry" from "fileName".  Returns NULL if the
+ * file is missing, belongs to some other entry, or is malformed.
+ */
+ZipSeekIndex* mzReadZipSeekIndex(const ZipEntry* pEntry,
+    const char* fileName)
+{
+    ZipSeekIndexHeader key, header;
+    ZipSeekIndex* pIndex = NULL;
+    struct stat st;
+    unsigned int i;
+    int fd;
+
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    makeSeekIndexKey(pEntry, &key);
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != key.magic || header.version != key.version ||
+        header.localHdrOffset != key.localHdrOffset ||
+        header.compLen != key.compLen || header.uncompLen != key.uncompLen ||
+        header.crc32 != key.crc32)
+    {
+        LOGV("Seek index '%s' is stale\n", fileName);
+        goto bail;
+    }
+
+    /* Checkpoints are at least "span" bytes apart, so there can't be more
+     * than one per span of output, and the file has to hold them all.
+     * Check before sizing the allocation from numPoints.
+     */
+    if (header.span < SEEK_SPAN_MIN ||
+        header.numPoints > header.uncompLen / header.span + 1 ||
+        header.numPoints > SIZE_MAX / sizeof(ZipSeekPoint))
+    {
+        LOGW("Seek index '%s' is corrupt (%u points)\n",
+            fileName, header.numPoints);
+        goto bail;
+    }
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(header) +
+            (uint64_t) header.numPoints *
+                (sizeof(ZipSeekIndexRecord) + SEEK_WINDOW_SIZE))
+    {
+        LOGW("Seek index '%s' is truncated\n", fileName);
+        goto bail;
+    }
+
+    pIndex = (ZipSeekIndex*) calloc(1, sizeof(ZipSeekIndex));
+    if (pIndex == NULL) {
+        goto bail;
+    }
+    pIndex->pEntry = pEntry;
+    pIndex->span = header.span;
+    if (header.numPoints > 0) {
+        pIndex->points = (ZipSeekPoint*)
+                malloc(header.numPoints * sizeof(ZipSeekPoint));
+        if (pIndex->points == NULL) {
+            goto bail;
+        }
+        pIndex->pointsCap = header.numPoints;
+    }
+    for (i = 0; i < header.numPoints; i++) {
+        ZipSeekPoint* pPoint = &pIndex->points[i];
+        ZipSeekIndexRecord record;
+
+        if (read(fd, &record, sizeof(record)) != sizeof(record) ||
+            read(fd, pPoint->window, SEEK_WINDOW_SIZE) != SEEK_WINDOW_SIZE)
+        {
+            LOGW("Seek index '%s' is truncated\n", fileName);
+            goto bail;
+        }
+        /* Checkpoints must be in order and inside the entry; the first
+         * byte of a resumed block can't be the first byte of the data.
+         */
+        if (record.uncompOffset > header.uncompLen ||
+            record.compOffset == 0 || record.compOffset > header.compLen ||
+            record.bits > 7 || record.windowLen > SEEK_WINDOW_SIZE ||
+            record.windowLen > record.uncompOffset ||
+            (i > 0 && record.uncompOffset <= pPoint[-1].uncompOffset))
+        {
+            LOGW("Seek index '%s' is corrupt (at %d)\n", fileName, i);
+            goto bail;
+        }
+        pPoint->uncompOffset = record.uncompOffset;
+        pPoint->compOffset = record.compOffset;
+        pPoint->bits = record.bits;
+        pPoint->windowLen = record.windowLen;
+        pIndex->numPoints++;
+    }
+    close(fd);
+    return pIndex;
+
+bail:
+    close(fd);
+    mzFreeZipSeekIndex(pIndex);
+    return NULL;
+}
+
+/*
+ * Attach a seek index to the archive, replacing any previous index for
+ * the same entry.  The archive frees it when it's closed.
+ */
+void mzAddZipSeekIndex(ZipArchive* pArchive, ZipSeekIndex* pIndex)
+{
+    ZipSeekIndex** ppIndex = &pArchive->pSeekIndexes;
+
+    while (*ppIndex != NULL) {
+        if ((*ppIndex)->pEntry == pIndex->pEntry) {
+            ZipSeekIndex* pOld = *ppIndex;
+            *ppIndex = pOld->next;
+            mzFreeZipSeekIndex(pOld);
+        } else {
+            ppIndex = &(*ppIndex)->next;
+        }
+    }
+    pIndex->next = pArchive->pSeekIndexes;
+    pArchive->pSeekIndexes = pIndex;
+}
+
+static void freeSeekIndexes(ZipArchive* pArchive)
+{
+    while (pArchive->pSeekIndexes != NULL) {
+        ZipSeekIndex* pIndex = pArchive->pSeekIndexes;
+        pArchive->pSeekIndexes = pIndex->next;
+        mzFreeZipSeekIndex(pIndex);
+    }
+}
+
+/*
+ * Find the last checkpoint at or before "offset" in the entry's seek
+ * index, if it has one.
+ */
+static const ZipSeekPoint* findSeekPoint(const ZipArchive* pArchive,
+    const ZipEntry* pEntry, long long offset)
+{
+    const ZipSeekIndex* pIndex;
+    unsigned int lo, hi;
+
+    for (pIndex = pArchive->pSeekIndexes; pIndex != NULL;
+         pIndex = pIndex->next)
+    {
+        if (pIndex->pEntry == pEntry) {
+            break;
+        }
+    }
+    if (pIndex == NULL) {
+        return NULL;
+    }
+
+    /* Find the number of checkpoints at or before "offset".
+     */
+    lo = 0;
+    hi = pIndex->numPoints;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (pIndex->points[mid].uncompOffset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? &pIndex->points[lo - 1] : NULL;
+}
+
+/*
+ * Read "len" bytes of uncompressed data, starting at "offset", into "buf".
+ */
+bool mzReadZipEntryRange(const ZipArchive* pArchive, const ZipEntry* pEntry,
+    long long offset, size_t len, unsigned char* buf)
+{
+    unsigned char discard[SEEK_WINDOW_SIZE];
+    const ZipSeekPoint* pPoint;
+    const unsigned char* data;
+    DataCursor cursor;
+    z_stream zstream;
+    size_t dataLen;
+    long long dataOffset;
+    long long compStart;
+    long long skip;
+    size_t fill;
+    bool filling = false;
+    int zerr;
+    bool ret = false;
+
+    if (offset < 0 || offset > pEntry->uncompLen ||
+        (unsigned long long)len >
+            (unsigned long long)(pEntry->uncompLen - offset))
+    {
+        LOGW("Range %lld+%zu is outside of '%.*s'\n", offset, len,
+            pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if (!getEntryDataOffset(pArchive, pEntry, &dataOffset)) {
+        return false;
+    }
+
+    if (pEntry->compression == STORED) {
+        dataCursorInit(&cursor, pArchive, dataOffset + offset, len);
+        while ((data = dataCursorNext(&cursor, &dataLen)) != NULL) {
+            memcpy(buf, data, dataLen);
+            buf += dataLen;
+        }
+        ret = (cursor.remaining == 0);
+        dataCursorEnd(&cursor);
+        return ret;
+    }
+    if (pEntry->compression != DEFLATED) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.data_type = Z_UNKNOWN;
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+
+    pPoint = findSeekPoint(pArchive, pEntry, offset);
+    if (pPoint != NULL) {
+        compStart = pPoint->compOffset;
+        if (pPoint->bits != 0) {
+            unsigned char partialBuf;
+            const unsigned char* partial = getArchiveBytes(pArchive,
+                    dataOffset + compStart - 1, &partialBuf, 1);
+            if (partial == NULL) {
+                goto z_bail;
+            }
+            inflatePrime(&zstream, pPoint->bits,
+                    *partial >> (8 - pPoint->bits));
+        }
+        inflateSetDictionary(&zstream, pPoint->window, pPoint->windowLen);
+        skip = offset - pPoint->uncompOffset;
+    } else {
+        compStart = 0;
+        skip = offset;
+    }
+
+    /* Inflate and throw away everything up to "offset", then inflate the
+     * range itself straight into "buf", in pieces zlib can count.
+     */
+    dataCursorInit(&cursor, pArchive, dataOffset + compStart,
+            pEntry->compLen - compStart);
+    for (;;) {
+        if (zstream.avail_out == 0) {
+            if (skip > 0) {
+                zstream.next_out = discard;
+                zstream.avail_out = skip > (long long)sizeof(discard) ?
+                        sizeof(discard) : (uInt) skip;
+                skip -= zstream.avail_out;
+            } else if (len > 0) {
+                fill = len > UINT_MAX ? UINT_MAX : len;
+                zstream.next_out = buf;
+                zstream.avail_out = fill;
+                buf += fill;
+                len -= fill;
+                filling = true;
+            } else {
+                break;
+            }
+        }
+        if (zstream.avail_in == 0 && cursor.remaining > 0) {
+            data = dataCursorNext(&cursor, &dataLen);
+            if (data == NULL) {
+                goto bail;
+            }
+            zstream.next_in = (Bytef*) data;
+            zstream.avail_in = dataLen;
+        }
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END) {
+            break;
+        }
+        if (zerr != Z_OK) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            goto bail;
+        }
+    }
+    if (!filling || zstream.avail_out != 0 || len != 0) {
+        LOGW("Entry '%.*s' ended early\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        goto bail;
+    }
+    ret = true;
+
+bail:
+    dataCursorEnd(&cursor);
+z_bail:
+    inflateEnd(&zstream);
+    return ret;
+}
+
+/*
+ * Forward-only reading of an archive from a pipe or socket.
+ *
+ * Nothing can be looked up in the central directory, which comes last,
+ * so each entry is described by its local file header.  Entries written
+ * by a streaming zipper have general purpose bit 3 set: the sizes and
+ * CRC in the local header are zero, and the real ones follow the data in
+ * a data descriptor.  For compressed entries the end of the data is found
+ * by decompressing up to the end of the compressed stream.
+ */
+#define STREAM_BUF_SIZE     (192 * 1024)    // a whole local header fits
+#define STREAM_OUT_SIZE     (64 * 1024)
+
+enum {
+    LOCFLG_ENCRYPTED = 1 << 0,
+    LOCFLG_DESCRIPTOR = 1 << 3,     // sizes and CRC follow the data
+};
+
+typedef struct {
+    int         fd;
+    unsigned char* buf;
+    size_t      pos;                // next unconsumed byte in buf
+    size_t      len;                // bytes of buf holding data
+    long long   offset;             // stream offset of buf[0]
+    bool        eof;
+} ZipStreamReader;
 
-    mzHashTableFree(pArchive->pHash);
+/*
+ * Read more data into the buffer, first moving the unconsumed bytes to
+ * the front.  Returns false at end of stream or on error.
+ */
+static bool streamFill(ZipStreamReader* pReader)
+{
+    ssize_t actual;
 
-    pArchive->fd = -1;
-    pArchive->pHash = NULL;
-    pArchive->pEntries = NULL;
+    if (pReader->pos > 0) {
+        memmove(pReader->buf, pReader->buf + pReader->pos,
+                pReader->len - pReader->pos);
+        pReader->offset += pReader->pos;
+        pReader->len -= pReader->pos;
+        pReader->pos = 0;
+    }
+    if (pReader->eof || pReader->len == STREAM_BUF_SIZE) {
+        return false;
+    }
+    do {
+        actual = read(pReader->fd, pReader->buf + pReader->len,
+                STREAM_BUF_SIZE - pReader->len);
+    } while (actual < 0 && errno == EINTR);
+    if (actual < 0) {
+        LOGW("Zip stream read failed: %s\n", strerror(errno));
+        pReader->eof = true;
+        return false;
+    }
+    if (actual == 0) {
+        pReader->eof = true;
+        return false;
+    }
+    pReader->len += actual;
+    return true;
 }
 
 /*
- * Find a matching entry.
- *
- * Returns NULL if no matching entry found.
+ * Make sure the next "count" bytes are in the buffer, and return a
+ * pointer to them.  They stay put until the next call to streamNeed().
+ * Returns NULL if the stream ends first.
  */
-const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
-        const char* entryName)
+static const unsigned char* streamNeed(ZipStreamReader* pReader,
+    size_t count)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
-
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    while (pReader->len - pReader->pos < count) {
+        if (!streamFill(pReader)) {
+            return NULL;
+        }
+    }
+    return pReader->buf + pReader->pos;
 }
 
 /*
- * Return true if the entry is a symbolic link.
+ * Read the data descriptor that follows an entry with bit 3 set, and
+ * check its sizes against what we actually found.  The signature is
+ * optional, so a descriptor whose CRC happens to equal EXTSIG is
+ * ambiguous; take whichever reading has the right sizes.
  */
-bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
+static bool readDataDescriptor(ZipStreamReader* pReader, bool zip64,
+    long long compLen, long long uncompLen, unsigned long* pCrc)
 {
-    if ((pEntry->versionMadeBy & 0xff00) == CENVEM_UNIX) {
-        return S_ISLNK(pEntry->externalFileAttributes >> 16);
+    size_t sizeLen = zip64 ? 8 : 4;
+    size_t descLen = 4 + 2 * sizeLen;
+    const unsigned char* ptr;
+    int withSig;
+
+    for (withSig = 1; withSig >= 0; withSig--) {
+        size_t skip = withSig ? 4 : 0;
+        unsigned long long descComp, descUncomp;
+
+        ptr = streamNeed(pReader, skip + descLen);
+        if (ptr == NULL || (withSig && get4LE(ptr) != EXTSIG)) {
+            continue;
+        }
+        ptr += skip;
+        descComp = zip64 ? get8LE(ptr + 4) : get4LE(ptr + 4);
+        descUncomp = zip64 ? get8LE(ptr + 4 + sizeLen) :
+                get4LE(ptr + 4 + sizeLen);
+        if (descComp == (unsigned long long)compLen &&
+            descUncomp == (unsigned long long)uncompLen)
+        {
+            *pCrc = get4LE(ptr);
+            pReader->pos += skip + descLen;
+            return true;
+        }
     }
+    LOGW("Bad data descriptor at stream offset %lld\n",
+        pReader->offset + (long long)pReader->pos);
     return false;
 }
 
-/* Call processFunction on the uncompressed data of a STORED entry.
+/*
+ * Pass the data of one entry through "processFunction" (if it's
+ * non-NULL), leaving the reader positioned after the data and its
+ * descriptor.  The CRC and sizes are checked once the data is done.
  */
-static bool processStoredEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+static bool processStreamEntry(ZipStreamReader* pReader, ZipEntry* pEntry,
+    bool descriptor, bool zip64,
+    ProcessZipEntryContentsFunction processFunction, void* cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
+    unsigned char* outBuf = NULL;
+    unsigned long crc = 0;
+    unsigned long expectedCrc;
+    long long totalIn = 0;
+    long long totalOut = 0;
+    const Decompressor* pDecomp = NULL;
+    void* state = NULL;
+    int status = DECOMP_OK;
+    bool ret = false;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
+    if (pEntry->compression == STORED) {
+        if (descriptor) {
+            LOGE("Can't find the end of STORED entry '%.*s' in a stream\n",
+                pEntry->fileNameLen, pEntry->fileName);
             return false;
         }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        while (totalIn < pEntry->compLen) {
+            size_t avail;
+
+            if (pReader->pos == pReader->len && !streamFill(pReader)) {
+                goto truncated;
+            }
+            avail = pReader->len - pReader->pos;
+            if ((long long)avail > pEntry->compLen - totalIn) {
+                avail = pEntry->compLen - totalIn;
+            }
+            crc = mzCrc32(crc, pReader->buf + pReader->pos, avail);
+            if (processFunction != NULL &&
+                !processFunction(pReader->buf + pReader->pos, avail, cookie))
+            {
+                LOGW("Process function elected to fail (in stream)\n");
+                return false;
+            }
+            pReader->pos += avail;
+            totalIn += avail;
+        }
+        totalOut = totalIn;
+    } else if ((pDecomp = mzFindDecompressor(pEntry->compression)) != NULL) {
+        outBuf = (unsigned char*) malloc(STREAM_OUT_SIZE);
+        if (outBuf == NULL) {
             return false;
         }
-        bytesLeft -= count;
-    }
-    return true;
-}
+        state = pDecomp->begin();
+        if (state == NULL) {
+            goto bail;
+        }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
-{
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
-    z_stream zstream;
-    int zerr;
-    long compRemaining;
+        do {
+            size_t avail = pReader->len - pReader->pos;
+            size_t inLen;
+            const unsigned char* in;
+            unsigned char* out = outBuf;
+            size_t outLen = STREAM_OUT_SIZE;
 
-    compRemaining = pEntry->compLen;
+            /* Without a descriptor we know where the data ends, and
+             * mustn't let the decompressor run past it.  It may still
+             * have output to flush after the last byte, though.
+             */
+            if (!descriptor && (long long)avail > pEntry->compLen - totalIn) {
+                avail = pEntry->compLen - totalIn;
+            }
+            if (avail == 0 && (descriptor || totalIn < pEntry->compLen)) {
+                if (!streamFill(pReader)) {
+                    goto truncated;
+                }
+                continue;
+            }
+            in = pReader->buf + pReader->pos;
+            inLen = avail;
+            status = pDecomp->run(state, &in, &inLen, &out, &outLen);
+            if (status == DECOMP_ERROR) {
+                LOGW("Can't decompress '%.*s' (%s)\n",
+                    pEntry->fileNameLen, pEntry->fileName, pDecomp->name);
+                goto bail;
+            }
+            pReader->pos += avail - inLen;
+            totalIn += avail - inLen;
 
-    /*
-     * Initialize the zlib stream.
-     */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+            if (out != outBuf) {
+                crc = mzCrc32(crc, outBuf, out - outBuf);
+                totalOut += out - outBuf;
+                if (processFunction != NULL &&
+                    !processFunction(outBuf, out - outBuf, cookie))
+                {
+                    LOGW("Process function elected to fail (in stream)\n");
+                    goto bail;
+                }
+            }
+        } while (status != DECOMP_END);
+    } else {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
 
-    /*
-     * Use the undocumented "negative window bits" feature to tell zlib
-     * that there's no zlib header waiting for it.
-     */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
-    if (zerr != Z_OK) {
-        if (zerr == Z_VERSION_ERROR) {
-            LOGE("Installed zlib is not compatible with linked version (%s)\n",
-                ZLIB_VERSION);
-        } else {
-            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+    if (descriptor) {
+        if (!readDataDescriptor(pReader, zip64, totalIn, totalOut,
+                &expectedCrc))
+        {
+            goto bail;
         }
+        pEntry->compLen = totalIn;
+        pEntry->uncompLen = totalOut;
+    } else {
+        expectedCrc = (unsigned long) pEntry->crc32;
+        if (totalIn != pEntry->compLen || totalOut != pEntry->uncompLen) {
+            LOGW("Size mismatch on streamed entry '%.*s' (%lld vs %lld)\n",
+                pEntry->fileNameLen, pEntry->fileName,
+                totalOut, pEntry->uncompLen);
+            goto bail;
+        }
+    }
+    if (crc != expectedCrc) {
+        LOGW("CRC mismatch on streamed entry '%.*s' (%08lx vs %08lx)\n",
+            pEntry->fileNameLen, pEntry->fileName, crc, expectedCrc);
         goto bail;
     }
+    ret = true;
+    goto bail;
 
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
+truncated:
+    LOGW("Zip stream ended inside '%.*s'\n",
+        pEntry->fileNameLen, pEntry->fileName);
+bail:
+    if (state != NULL) {
+        pDecomp->end(state);
+    }
+    free(outBuf);
+    return ret;
+}
 
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
+/*
+ * Walk the local headers of the archive arriving on "fd".
+ */
+bool mzProcessZipStream(int fd, ProcessZipStreamEntryFunction entryFunction,
+    void* cookie)
+{
+    char fileName[PATH_MAX];
+    ZipStreamReader reader;
+    unsigned int numEntries = 0;
+    bool ret = false;
 
-            compRemaining -= getSize;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = fd;
+    reader.buf = (unsigned char*) malloc(STREAM_BUF_SIZE);
+    if (reader.buf == NULL) {
+        return false;
+    }
+
+    for (;;) {
+        ProcessZipEntryContentsFunction processFunction = NULL;
+        void* processCookie = NULL;
+        unsigned long long compLen, uncompLen, localHdrOffset;
+        const unsigned char* ptr;
+        unsigned int flags, nameLen, extraLen;
+        unsigned int sig;
+        bool zip64;
+        ZipEntry entry;
 
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
+        ptr = streamNeed(&reader, 4);
+        if (ptr == NULL) {
+            LOGW("Zip stream ended before the central directory\n");
+            goto bail;
+        }
+        sig = get4LE(ptr);
+        if (sig == CENSIG || sig == ENDSIG || sig == ZIP64_ENDSIG) {
+            break;
+        }
+        if (sig == EXTSIG && numEntries == 0 &&
+            reader.offset + reader.pos == 0)
+        {
+            /* Spanning marker written by some zippers; skip it.
+             */
+            reader.pos += 4;
+            continue;
+        }
+        if (sig != LOCSIG) {
+            LOGW("Unexpected signature 0x%08x at stream offset %lld\n",
+                sig, reader.offset + (long long)reader.pos);
+            goto bail;
         }
 
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
+        ptr = streamNeed(&reader, LOCHDR);
+        if (ptr == NULL) {
+            LOGW("Zip stream ended inside a local header\n");
+            goto bail;
+        }
+        flags = get2LE(ptr + LOCFLG);
+        nameLen = get2LE(ptr + LOCNAM);
+        extraLen = get2LE(ptr + LOCEXT);
+        ptr = streamNeed(&reader, LOCHDR + nameLen + extraLen);
+        if (ptr == NULL) {
+            LOGW("Zip stream ended inside a local header\n");
+            goto bail;
         }
 
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
+        if (!validFilename((const char*) ptr + LOCHDR, nameLen)) {
+            goto bail;
+        }
+        if (flags & LOCFLG_ENCRYPTED) {
+            LOGW("Entry '%.*s' is encrypted\n", nameLen, ptr + LOCHDR);
+            goto bail;
+        }
+
+        /* The header is about to be consumed, and the buffer reused, so
+         * the entry gets its own copy of the name.
+         */
+        memcpy(fileName, ptr + LOCHDR, nameLen);
+        memset(&entry, 0, sizeof(entry));
+        entry.fileName = fileName;
+        entry.fileNameLen = nameLen;
+        entry.localHdrOffset = reader.offset + reader.pos;
+        entry.compression = get2LE(ptr + LOCHOW);
+        entry.modTime = get4LE(ptr + LOCTIM);
+        entry.crc32 = get4LE(ptr + LOCCRC);
+
+        /* A Zip64 extra field also means that the descriptor, if any,
+         * has 64-bit sizes.
+         */
+        compLen = get4LE(ptr + LOCSIZ);
+        uncompLen = get4LE(ptr + LOCLEN);
+        localHdrOffset = 0;
+        zip64 = parseZip64Extra(ptr + LOCHDR + nameLen, extraLen,
+                &uncompLen, &compLen, &localHdrOffset);
+        if (flags & LOCFLG_DESCRIPTOR) {
+            compLen = uncompLen = 0;
+            entry.crc32 = 0;
+        } else if (compLen == ZIP64_MAGIC32 || uncompLen == ZIP64_MAGIC32 ||
+            compLen > (unsigned long long)LLONG_MAX ||
+            uncompLen > (unsigned long long)LLONG_MAX)
         {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
+            LOGW("Bad Zip64 extra field for '%.*s'\n", nameLen, fileName);
+            goto bail;
+        }
+        entry.compLen = compLen;
+        entry.uncompLen = uncompLen;
+        reader.pos += LOCHDR + nameLen + extraLen;
 
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+        if (!entryFunction(&entry, &processFunction, &processCookie,
+                cookie))
+        {
+            LOGW("Entry function elected to fail (in stream)\n");
+            goto bail;
+        }
+        if (!processStreamEntry(&reader, &entry,
+                (flags & LOCFLG_DESCRIPTOR) != 0, zip64,
+                processFunction, processCookie))
+        {
+            goto bail;
         }
-    } while (zerr == Z_OK);
+        numEntries++;
+    }
+    LOGV("Streamed %u entries\n", numEntries);
+    ret = true;
 
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
+bail:
+    free(reader.buf);
+    return ret;
+}
 
-    // success!
-    result = zstream.total_out;
+/*
+ * Buffered output for mzExtractZipEntryToFile().  The pieces handed to
+ * the process function are whatever size the decompressor produced, so
+ * they are gathered up and written WRITE_CHUNK_SIZE at a time, each write
+ * ending on a chunk boundary of the file.  Pieces that cover a whole
+ * chunk by themselves are written straight from the caller's buffer.
+ */
+#define WRITE_CHUNK_SIZE (256 * 1024)
 
-z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
+typedef struct {
+    int             fd;
+    long long       offset;     // file offset of buf[0]
+    unsigned char*  buf;        // WRITE_CHUNK_SIZE bytes, or NULL
+    size_t          len;        // bytes waiting in buf
+} ChunkWriter;
 
-bail:
-    if (result != pEntry->uncompLen) {
-        if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
-        return false;
+static bool writeChunk(ChunkWriter* pWriter, const unsigned char* data,
+    size_t len)
+{
+    pWriter->offset += len;
+    while (len > 0) {
+        ssize_t n = write(pWriter->fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Error writing %zu bytes from zip file from %p: %s\n",
+                 len, data, strerror(errno));
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool flushChunkWriter(ChunkWriter* pWriter)
+{
+    size_t len = pWriter->len;
+
+    pWriter->len = 0;
+    return writeChunk(pWriter, pWriter->buf, len);
+}
+
+static bool writeProcessFunction(const unsigned char *data, int dataLen,
+                                 void *cookie)
+{
+    ChunkWriter* pWriter = (ChunkWriter*) cookie;
+
+    while (dataLen > 0) {
+        /* Room left before the next chunk boundary.
+         */
+        size_t room = WRITE_CHUNK_SIZE -
+                (pWriter->offset + pWriter->len) % WRITE_CHUNK_SIZE;
+        size_t n = (size_t) dataLen < room ? (size_t) dataLen : room;
+
+        if (pWriter->buf == NULL || (pWriter->len == 0 && n == room)) {
+            /* Take every whole chunk there is in one go.
+             */
+            if (pWriter->buf != NULL) {
+                n += (dataLen - n) / WRITE_CHUNK_SIZE * WRITE_CHUNK_SIZE;
+            }
+            if (!writeChunk(pWriter, data, n)) {
+                return false;
+            }
+        } else {
+            memcpy(pWriter->buf + pWriter->len, data, n);
+            pWriter->len += n;
+            if (n == room && !flushChunkWriter(pWriter)) {
+                return false;
+            }
+        }
+        data += n;
+        dataLen -= n;
     }
     return true;
 }
 
 /*
- * Stream the uncompressed data through the supplied function,
- * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
+ * Try to decompress a large compressed entry directly into the pages of
+ * the output file, by extending the file, mapping the new part and
+ * decompressing into the mapping in one shot.
  *
- * If processFunction returns false, the operation is abandoned and
- * mzProcessZipEntryContents() immediately returns false.
+ * This only works if "fd" is a regular file opened for reading and
+ * writing, positioned at its end.  The new blocks are allocated up front
+ * with fallocate(), so running out of space shows up as an error here
+ * rather than as a SIGBUS while writing to the mapping.
  *
- * This is useful for calculating the hash of an entry's uncompressed contents.
+ * Returns MMAP_EXTRACT_UNAVAILABLE, leaving the file untouched, if the
+ * fast path can't be used and the caller should fall back to write().
  */
-bool mzProcessZipEntryContents(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+#define MMAP_EXTRACT_MIN (256 * 1024)
+#define MMAP_EXTRACT_MAX (256 * 1024 * 1024)    // keep the mapping modest
+enum { MMAP_EXTRACT_FAILED, MMAP_EXTRACT_OK, MMAP_EXTRACT_UNAVAILABLE };
+
+static int extractEntryToMappedFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
 {
-    bool ret = false;
-    off_t oldOff;
+    struct stat st;
+    off_t start, mapStart;
+    size_t adjust;
+    void *mapped;
+    bool ok;
 
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
+    if (mzFindDecompressor(pEntry->compression) == NULL ||
+        pEntry->uncompLen < MMAP_EXTRACT_MIN ||
+        pEntry->uncompLen > MMAP_EXTRACT_MAX)
+    {
+        return MMAP_EXTRACT_UNAVAILABLE;
+    }
+    start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size != start)
+    {
+        return MMAP_EXTRACT_UNAVAILABLE;
+    }
+    if ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR) {
+        return MMAP_EXTRACT_UNAVAILABLE;
+    }
+    if (fallocate(fd, 0, start, pEntry->uncompLen) != 0) {
+        /* Not supported by this filesystem, or no room; let the
+         * write() path deal with it.
+         */
+        ftruncate(fd, start);
+        return MMAP_EXTRACT_UNAVAILABLE;
+    }
 
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+    adjust = start % sysconf(_SC_PAGESIZE);
+    mapStart = start - adjust;
+    mapped = mmap(NULL, pEntry->uncompLen + adjust, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, mapStart);
+    if (mapped == MAP_FAILED) {
+        ftruncate(fd, start);
+        return MMAP_EXTRACT_UNAVAILABLE;
+    }
 
-    switch (pEntry->compression) {
-    case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
-        break;
+    ok = decompressEntryToBuffer(pArchive, pEntry,
+            (unsigned char *)mapped + adjust);
+    munmap(mapped, pEntry->uncompLen + adjust);
+    if (!ok) {
+        ftruncate(fd, start);
+        return MMAP_EXTRACT_FAILED;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
-    return ret;
+    /* Leave the file positioned after the data, as write() would.
+     */
+    lseek(fd, start + pEntry->uncompLen, SEEK_SET);
+    return MMAP_EXTRACT_OK;
 }
 
-static bool crcProcessFunction(const unsigned char *data, int dataLen,
-        void *crc)
+/*
+ * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ */
+bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+    switch (extractEntryToMappedFile(pArchive, pEntry, fd)) {
+    case MMAP_EXTRACT_OK:
+        return true;
+    case MMAP_EXTRACT_FAILED:
+        LOGE("Can't extract entry to file.\n");
+        return false;
+    }
+
+    ChunkWriter writer;
+    bool ret;
+
+    writer.fd = fd;
+    writer.offset = lseek(fd, 0, SEEK_CUR);
+    if (writer.offset < 0) {
+        writer.offset = 0;      // a pipe; there's nothing to line up with
+    }
+    writer.buf = NULL;
+    writer.len = 0;
+    if (pEntry->uncompLen > WRITE_CHUNK_SIZE / 2) {
+        writer.buf = (unsigned char*) malloc(WRITE_CHUNK_SIZE);
+    }
+
+    /* Reserve the space up front, so the filesystem can hand it out in
+     * as few extents as possible.  KEEP_SIZE leaves the file's size and
+     * contents alone; if it isn't supported, the writes still work.
+     */
+    if (pEntry->uncompLen >= WRITE_CHUNK_SIZE) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, writer.offset, pEntry->uncompLen);
+    }
+
+    ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
+                                    &writer);
+    if (ret && writer.len > 0) {
+        ret = flushChunkWriter(&writer);
+    }
+    free(writer.buf);
+    if (!ret) {
+        LOGE("Can't extract entry to file.\n");
+        return false;
+    }
     return true;
 }
 
 /*
- * Check the CRC on this entry; return true if it is correct.
- * May do other internal checks as well.
+ * Sparse extraction.
+ *
+ * Block-aligned runs of zeros aren't written at all: past the old end of
+ * the file they are simply skipped, which leaves a hole, and over
+ * existing data they are punched out.  Since the output is only ever
+ * checked a block at a time, zeros that don't fill a whole block are
+ * written like any other data.
  */
-bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
+#define SPARSE_BLOCK_SIZE 4096
+
+/*
+ * Return true if the SPARSE_BLOCK_SIZE bytes at "p" are all zero.  This
+ * is on the path of every byte we extract, so look at 64 bytes per step.
+ */
+static bool isZeroBlock(const unsigned char* p)
 {
-    unsigned long crc;
-    bool ret;
+    const unsigned char* end = p + SPARSE_BLOCK_SIZE;
 
-    crc = crc32(0L, Z_NULL, 0);
-    ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
-            (void *)&crc);
-    if (!ret) {
-        LOGE("Can't calculate CRC for entry\n");
-        return false;
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    for (; p < end; p += 64) {
+        uint8x16_t acc = vorrq_u8(
+                vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+                vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+        uint64x2_t wide = vreinterpretq_u64_u8(acc);
+        if ((vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) != 0) {
+            return false;
+        }
     }
-    if (crc != (unsigned long)pEntry->crc32) {
-        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
-        return false;
+#elif defined(__SSE2__)
+    for (; p < end; p += 64) {
+        __m128i acc = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i*) p),
+                        _mm_loadu_si128((const __m128i*) (p + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i*) (p + 32)),
+                        _mm_loadu_si128((const __m128i*) (p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128()))
+                != 0xffff)
+        {
+            return false;
+        }
+    }
+#else
+    for (; p < end; p += 64) {
+        unsigned long acc = 0;
+        unsigned int i;
+        for (i = 0; i < 64; i += sizeof(acc)) {
+            unsigned long word;
+            memcpy(&word, p + i, sizeof(word));
+            acc |= word;
+        }
+        if (acc != 0) {
+            return false;
+        }
     }
+#endif
     return true;
 }
 
 typedef struct {
-    char *buf;
-    int bufLen;
-} CopyProcessArgs;
+    int         fd;
+    long long   offset;         // file offset of the next byte of output
+    long long   holeLen;        // bytes of zeros just before "offset"
+    long long   oldSize;        // size of the file when we started
+    long long   skipped;        // bytes of zeros not written
+} SparseWriter;
 
-static bool copyProcessFunction(const unsigned char *data, int dataLen,
-        void *cookie)
+/*
+ * Write "len" bytes at "offset" with pwrite(), whatever it takes.
+ */
+static bool writeFully(int fd, const unsigned char* data, size_t len,
+    long long offset)
 {
-    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
-    if (dataLen <= args->bufLen) {
-        memcpy(args->buf, data, dataLen);
-        args->buf += dataLen;
-        args->bufLen -= dataLen;
-        return true;
+    while (len > 0) {
+        ssize_t n = pwrite64(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Error writing %zu bytes at %lld: %s\n",
+                len, offset, strerror(errno));
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
     }
-    return false;
+    return true;
 }
 
 /*
- * Read an entry into a buffer allocated by the caller.
+ * Deal with the pending run of zero blocks.  Only the part over the old
+ * contents of the file needs any work; if the filesystem can't punch
+ * holes, zeros are written there after all.
  */
-bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
-        char *buf, int bufLen)
+static bool flushSparseHole(SparseWriter* pWriter)
 {
-    CopyProcessArgs args;
-    bool ret;
+    static const unsigned char zeros[SPARSE_BLOCK_SIZE];
+    long long start = pWriter->offset - pWriter->holeLen;
+    long long end = pWriter->offset < pWriter->oldSize ?
+            pWriter->offset : pWriter->oldSize;
 
-    args.buf = buf;
-    args.bufLen = bufLen;
-    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
-            (void *)&args);
-    if (!ret) {
-        LOGE("Can't extract entry to buffer.\n");
+    pWriter->holeLen = 0;
+    if (start >= end) {
+        return true;
+    }
+    if ((off_t) start == start && (off_t) (end - start) == end - start &&
+        fallocate(pWriter->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                start, end - start) == 0)
+    {
+        return true;
+    }
+    pWriter->skipped -= end - start;
+    for (; start < end; start += SPARSE_BLOCK_SIZE) {
+        if (!writeFully(pWriter->fd, zeros, SPARSE_BLOCK_SIZE, start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool writeSparseRun(SparseWriter* pWriter, const unsigned char* data,
+    size_t len)
+{
+    if (len == 0) {
+        return true;
+    }
+    if (pWriter->holeLen > 0 && !flushSparseHole(pWriter)) {
+        return false;
+    }
+    if (!writeFully(pWriter->fd, data, len, pWriter->offset)) {
         return false;
     }
+    pWriter->offset += len;
     return true;
 }
 
-static bool writeProcessFunction(const unsigned char *data, int dataLen,
-                                 void *cookie)
+static bool sparseWriteProcessFunction(const unsigned char *data,
+    int dataLen, void *cookie)
 {
-    int fd = (int)cookie;
+    SparseWriter* pWriter = (SparseWriter*) cookie;
+    const unsigned char* run = data;    // data not yet written
+    size_t runLen = 0;
 
-    ssize_t soFar = 0;
-    while (true) {
-        ssize_t n = write(fd, data+soFar, dataLen-soFar);
-        if (n <= 0) {
-            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
-                 dataLen-soFar, data+soFar, strerror(errno));
-            if (errno != EINTR) {
-              return false;
-            }
-        } else if (n > 0) {
-            soFar += n;
-            if (soFar == dataLen) return true;
-            if (soFar > dataLen) {
-                LOGE("write overrun?  (%ld bytes instead of %d)\n",
-                     soFar, dataLen);
+    /* Split the data at file block boundaries, so that every whole block
+     * can be checked; consecutive blocks that aren't zero go out in one
+     * write.
+     */
+    while (dataLen > 0) {
+        size_t len = SPARSE_BLOCK_SIZE -
+                (pWriter->offset + runLen) % SPARSE_BLOCK_SIZE;
+        if (len > (size_t) dataLen) {
+            len = dataLen;
+        }
+        if (len == SPARSE_BLOCK_SIZE && isZeroBlock(data)) {
+            if (!writeSparseRun(pWriter, run, runLen)) {
                 return false;
             }
+            pWriter->offset += len;
+            pWriter->holeLen += len;
+            pWriter->skipped += len;
+            run = data + len;
+            runLen = 0;
+        } else {
+            runLen += len;
         }
+        data += len;
+        dataLen -= len;
     }
+    return writeSparseRun(pWriter, run, runLen);
 }
 
 /*
- * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ * Extract an entry to "fd", leaving holes where it has whole blocks of
+ * zeros.
  */
-bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
+bool mzExtractZipEntryToSparseFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
-    if (!ret) {
+    SparseWriter writer;
+    struct stat st;
+    off_t start;
+
+    start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        /* Not a file we can leave holes in; just write it out.
+         */
+        return mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    }
+
+    memset(&writer, 0, sizeof(writer));
+    writer.fd = fd;
+    writer.offset = start;
+    writer.oldSize = st.st_size;
+
+    if (!mzProcessZipEntryContents(pArchive, pEntry,
+            sparseWriteProcessFunction, &writer) ||
+        (writer.holeLen > 0 && !flushSparseHole(&writer)))
+    {
         LOGE("Can't extract entry to file.\n");
         return false;
     }
+
+    /* A hole at the very end still has to count towards the size.
+     */
+    if (writer.offset > st.st_size && ftruncate(fd, writer.offset) != 0) {
+        LOGE("Can't extend file to %lld bytes: %s\n",
+            writer.offset, strerror(errno));
+        return false;
+    }
+    lseek(fd, writer.offset, SEEK_SET);
+
+    LOGV("Skipped %lld of %lld bytes of zeros in '%.*s'\n",
+        writer.skipped, pEntry->uncompLen,
+        pEntry->fileNameLen, pEntry->fileName);
     return true;
 }
 
@@ -825,7 +3534,8 @@ typedef struct {
  * return the target filename of the provided entry.
  * The helper must be initialized first.
  */
-static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
+static const char *targetEntryPath(MzPathHelper *helper,
+    const ZipEntry *pEntry)
 {
     int needLen;
     bool firstTime = (helper->buf == NULL);
@@ -870,6 +3580,321 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * Extract a single non-directory entry to "targetFile".  The directory
+ * that will contain the file must already exist.
+ *
+ * Only touches the archive through the read functions, so this may be
+ * called from several threads at once.
+ */
+static bool extractFileEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *targetFile, int flags,
+    const struct utimbuf *timestamp)
+{
+    /* With FILES_ONLY set, we need to ignore metadata entirely,
+     * so treat symlinks as regular files.
+     */
+    if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
+        /* The entry is a symbolic link.
+         * The relative target of the symlink is in the
+         * data section of this entry.
+         */
+        if (pEntry->uncompLen == 0) {
+            LOGE("Symlink entry \"%s\" has no target\n",
+                    targetFile);
+            return false;
+        }
+        if (pEntry->uncompLen >= PATH_MAX) {
+            LOGE("Symlink entry \"%s\" has a %lld-byte target\n",
+                    targetFile, pEntry->uncompLen);
+            return false;
+        }
+        char *linkTarget = malloc(pEntry->uncompLen + 1);
+        if (linkTarget == NULL) {
+            return false;
+        }
+        if (!mzReadZipEntry(pArchive, pEntry, linkTarget,
+                pEntry->uncompLen)) {
+            LOGE("Can't read symlink target for \"%s\"\n",
+                    targetFile);
+            free(linkTarget);
+            return false;
+        }
+        linkTarget[pEntry->uncompLen] = '\0';
+
+        /* Make the link.
+         */
+        if (symlink(linkTarget, targetFile) != 0) {
+            LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                    targetFile, linkTarget, strerror(errno));
+            free(linkTarget);
+            return false;
+        }
+        LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+                targetFile, linkTarget);
+        free(linkTarget);
+        return true;
+    }
+
+    /* The entry is a regular file.
+     * Open the target for writing.  Ask for read access too, so that
+     * mzExtractZipEntryToFile() can map it.
+     */
+    int fd = open(targetFile, O_RDWR | O_CREAT | O_TRUNC, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = (flags & MZ_EXTRACT_SPARSE) ?
+            mzExtractZipEntryToSparseFile(pArchive, pEntry, fd) :
+            mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    if (!ok) {
+        close(fd);
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    /* Set the times through the descriptor we already have, rather than
+     * looking the path up all over again.
+     */
+    if (timestamp != NULL) {
+        struct timespec times[2];
+
+        times[0].tv_sec = timestamp->actime;
+        times[0].tv_nsec = 0;
+        times[1].tv_sec = timestamp->modtime;
+        times[1].tv_nsec = 0;
+        if (futimens(fd, times) != 0) {
+            close(fd);
+            LOGE("Error touching \"%s\"\n", targetFile);
+            return false;
+        }
+    }
+    close(fd);
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/*
+ * State for MZ_EXTRACT_PARALLEL.
+ *
+ * mzExtractRecursive() walks the matching entries on the calling thread,
+ * creating directories and symlinks as it goes, and queues up every
+ * entry as a job; only regular files are left for the workers.  A pool
+ * of worker threads then claims jobs in archive order and extracts them
+ * concurrently, while the calling thread waits for each job in turn and
+ * invokes the callback for it.  The callback therefore
+ * sees exactly the same sequence as in a serial extraction, always on
+ * the caller's thread.
+ */
+#define MAX_EXTRACT_THREADS 8
+
+enum { JOB_PENDING, JOB_DONE, JOB_FAILED };
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    bool needsExtract;      // false if the walk already handled the entry
+    int state;
+} ExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    int flags;
+    const struct utimbuf *timestamp;
+
+    ExtractJob *jobs;
+    unsigned int numJobs;
+    unsigned int jobsCap;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobDone;     // signalled whenever a job finishes
+    unsigned int nextJob;       // next job for a worker to claim
+    bool abort;                 // stop claiming new jobs
+} ExtractPool;
+
+static bool addExtractJob(ExtractPool *pool, const ZipEntry *pEntry,
+    const char *targetFile, bool needsExtract)
+{
+    if (pool->numJobs == pool->jobsCap) {
+        unsigned int newCap = pool->jobsCap ? pool->jobsCap * 2 : 64;
+        ExtractJob *newJobs = (ExtractJob *)realloc(pool->jobs,
+                newCap * sizeof(ExtractJob));
+        if (newJobs == NULL) {
+            return false;
+        }
+        pool->jobs = newJobs;
+        pool->jobsCap = newCap;
+    }
+
+    ExtractJob *job = &pool->jobs[pool->numJobs];
+    job->targetFile = strdup(targetFile);
+    if (job->targetFile == NULL) {
+        return false;
+    }
+    job->pEntry = pEntry;
+    job->needsExtract = needsExtract;
+    job->state = needsExtract ? JOB_PENDING : JOB_DONE;
+    pool->numJobs++;
+    return true;
+}
+
+static void *extractWorker(void *cookie)
+{
+    ExtractPool *pool = (ExtractPool *)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->abort && pool->nextJob < pool->numJobs) {
+        ExtractJob *job = &pool->jobs[pool->nextJob++];
+        if (!job->needsExtract) {
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractFileEntry(pool->pArchive, job->pEntry,
+                job->targetFile, pool->flags, pool->timestamp);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = ok ? JOB_DONE : JOB_FAILED;
+        pthread_cond_broadcast(&pool->jobDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Run all queued jobs, invoking the callback for each one in order.
+ *
+ * Returns false if any job failed.  In that case the callback has been
+ * invoked for every job before the first failing one (in archive order)
+ * and for none after it, just like a serial extraction.  Files queued
+ * after the failing entry may or may not have been written.
+ */
+static bool runExtractPool(ExtractPool *pool,
+    void (*callback)(const char *fn, void *), void *cookie)
+{
+    pthread_t threads[MAX_EXTRACT_THREADS];
+    unsigned int numThreads, numFiles, i;
+    bool ok = true;
+
+    numFiles = 0;
+    for (i = 0; i < pool->numJobs; i++) {
+        if (pool->jobs[i].needsExtract) numFiles++;
+    }
+
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    numThreads = (numCpus > 0) ? (unsigned int)numCpus : 1;
+    if (numThreads > MAX_EXTRACT_THREADS) numThreads = MAX_EXTRACT_THREADS;
+    if (numThreads > numFiles) numThreads = numFiles;
+
+    for (i = 0; i < numThreads; i++) {
+        int err = pthread_create(&threads[i], NULL, extractWorker, pool);
+        if (err != 0) {
+            LOGW("Can't start extract thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    numThreads = i;
+    if (numThreads == 0) {
+        /* No threads at all; just do the work here.
+         */
+        extractWorker(pool);
+    }
+
+    for (i = 0; i < pool->numJobs; i++) {
+        ExtractJob *job = &pool->jobs[i];
+
+        pthread_mutex_lock(&pool->lock);
+        while (job->state == JOB_PENDING) {
+            pthread_cond_wait(&pool->jobDone, &pool->lock);
+        }
+        if (job->state == JOB_FAILED) {
+            pool->abort = true;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job->state == JOB_FAILED) {
+            ok = false;
+            break;
+        }
+        if (callback != NULL) callback(job->targetFile, cookie);
+    }
+
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return ok;
+}
+
+/*
+ * Decide whether the entries in "range" can be extracted by a pool
+ * without changing the result.  The walk creates every directory before
+ * any worker runs, so that's only safe when no file or symlink stands
+ * where a later entry needs a directory (e.g. "system/vendor" as a link
+ * to "/vendor" followed by "system/vendor/lib/..."); a serial run would
+ * create the link first.  Duplicate names are out too, since two workers
+ * could write the same file at once.
+ *
+ * Entries come in sorted order, so duplicates are neighbours and any
+ * "name/..." entries follow "name".
+ */
+static bool canExtractInParallel(const ZipArchive *pArchive,
+    ZipEntryIter range)
+{
+    const ZipEntry *pPrev = NULL;
+    char *prefix = NULL;
+    unsigned int prefixCap = 0;
+    bool result = true;
+
+    for (; !mzZipEntryIterDone(&range); mzZipEntryIterNext(&range)) {
+        const ZipEntry *pEntry = mzZipEntryIterEntry(&range);
+        unsigned int first, end;
+
+        if (pPrev != NULL && pPrev->fileNameLen == pEntry->fileNameLen &&
+            memcmp(pPrev->fileName, pEntry->fileName,
+                pEntry->fileNameLen) == 0)
+        {
+            LOGI("Duplicate entry \"%.*s\"; extracting serially\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            result = false;
+            break;
+        }
+        pPrev = pEntry;
+        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+            continue;
+        }
+
+        if (pEntry->fileNameLen + 1 > prefixCap) {
+            char *newPrefix = (char *)realloc(prefix, pEntry->fileNameLen + 1);
+            if (newPrefix == NULL) {
+                result = false;
+                break;
+            }
+            prefix = newPrefix;
+            prefixCap = pEntry->fileNameLen + 1;
+        }
+        memcpy(prefix, pEntry->fileName, pEntry->fileNameLen);
+        prefix[pEntry->fileNameLen] = '/';
+        findPrefixRange(pArchive, prefix, pEntry->fileNameLen + 1,
+                &first, &end);
+        if (first < end) {
+            LOGI("Entries under non-directory \"%.*s\"; "
+                    "extracting serially\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            result = false;
+            break;
+        }
+    }
+    free(prefix);
+    return result;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -939,50 +3964,51 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+    /* Most entries land in a directory that an earlier entry already
+     * needed, so remember the ones we've been through.
      */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    DirCache *dirCache = dirCacheCreate();
+    if (dirCache == NULL) {
+        LOGE("Can't allocate directory cache\n");
+        free(zpath);
+        return false;
+    }
+
+    /* In parallel mode, file entries are queued up here and extracted
+     * by runExtractPool() once the walk is done.  A dry run has nothing
+     * worth parallelizing.
+     */
+    ZipEntryIter iter;
+    ExtractPool pool;
+    bool parallel = (flags & MZ_EXTRACT_PARALLEL) &&
+            !(flags & MZ_EXTRACT_DRY_RUN);
+    if (parallel) {
+        mzZipEntryIterBegin(pArchive, zpath, &iter);
+        parallel = canExtractInParallel(pArchive, iter);
+    }
+    if (parallel) {
+        memset(&pool, 0, sizeof(pool));
+        pool.pArchive = pArchive;
+        pool.flags = flags;
+        pool.timestamp = timestamp;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.jobDone, NULL);
+    }
+
+    /* Walk through the entries whose path begins with zpath and
+     * extract them.  If zpath is empty, this will match everything,
+     * which is what we want.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+     */
+    unsigned int i;
+    int ok = true;
+    for (mzZipEntryIterBegin(pArchive, zpath, &iter);
+         !mzZipEntryIterDone(&iter); mzZipEntryIterNext(&iter))
+    {
+        const ZipEntry *pEntry = mzZipEntryIterEntry(&iter);
 
         /* Find the target location of the entry.
          */
@@ -1003,11 +4029,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
-        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+        bool isDir = (pEntry->fileName[pEntry->fileNameLen-1] == '/');
+        bool isLink = false;
+        if (isDir) {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
+                int ret = dirCacheCreateHierarchy(dirCache,
                         targetFile, UNZIP_DIRMODE, timestamp, false);
                 if (ret != 0) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -1021,7 +4047,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
+            int ret = dirCacheCreateHierarchy(dirCache,
                     targetFile, UNZIP_DIRMODE, timestamp, true);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -1030,81 +4056,46 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 break;
             }
 
-            /* With FILES_ONLY set, we need to ignore metadata entirely,
-             * so treat symlinks as regular files.
+            /* Symlinks are cheap, and making them here keeps them in
+             * archive order with the directories.
              */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
-                 */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
+            isLink = !(flags & MZ_EXTRACT_FILES_ONLY) &&
+                    mzIsZipEntrySymlink(pEntry);
+            if ((!parallel || isLink) && !extractFileEntry(pArchive, pEntry,
+                        targetFile, flags, timestamp)) {
+                ok = false;
+                break;
+            }
+        }
 
-                LOGD("Extracted file \"%s\"\n", targetFile);
+        if (parallel) {
+            if (!addExtractJob(&pool, pEntry, targetFile, !isDir && !isLink)) {
+                LOGE("Can't queue \"%s\" for extraction\n", targetFile);
+                ok = false;
+                break;
             }
+        } else {
+            if (callback != NULL) callback(targetFile, cookie);
         }
+    }
 
-        if (callback != NULL) callback(targetFile, cookie);
+    if (parallel) {
+        /* Even if the walk failed part way through, the entries before
+         * the failure are extracted (and reported) as they would have
+         * been in a serial run.
+         */
+        if (!runExtractPool(&pool, callback, cookie)) {
+            ok = false;
+        }
+        for (i = 0; i < pool.numJobs; i++) {
+            free(pool.jobs[i].targetFile);
+        }
+        free(pool.jobs);
+        pthread_cond_destroy(&pool.jobDone);
+        pthread_mutex_destroy(&pool.lock);
     }
 
+    dirCacheFree(dirCache);
     free(helper.buf);
     free(zpath);
 
@@ -8,10 +8,10 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 /*
@@ -25,9 +25,9 @@
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    long long    localHdrOffset; // data offset is resolved on demand
+    long long    compLen;
+    long long    uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -35,15 +35,38 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * One slot in an archive's name index.  Treat as opaque.
+ */
+typedef struct ZipIndexSlot {
+    unsigned int hash;          // hash of the entry's name
+    unsigned int nameLen;       // length of the entry's name
+    unsigned int entry;         // index into pEntries
+} ZipIndexSlot;
+
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * Once opened, an archive is never modified by the read functions below;
+ * entry data is fetched with pread() or straight from the mapping, so
+ * the file position of "fd" is never used.  Any number of threads may
+ * read from the same archive concurrently.
+ *
+ * Small archives are mapped whole.  Large ones only have the central
+ * directory and everything after it mapped ("map" starts at file offset
+ * "mapOffset"), and entry data is mapped a window at a time as needed.
  */
 typedef struct ZipArchive {
     int         fd;
+    long long   fileLength;
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    ZipIndexSlot* pIndex;       // maps file name to ZipEntry
+    unsigned int indexMask;     // number of slots in pIndex, minus 1
     MemMapping  map;
+    long long   mapOffset;      // file offset of map.addr
+    MemMapping  indexMap;       // index sidecar, if pIndex was loaded
+    struct ZipSeekIndex* pSeekIndexes;  // see mzAddZipSeekIndex()
 } ZipArchive;
 
 /*
@@ -58,11 +81,53 @@ typedef struct {
 /*
  * Open a Zip archive.
  *
+ * Zip64 archives are supported, so neither the archive nor its entries
+ * are limited to 4GB, and there can be more than 65535 entries.
+ *
  * On success, returns 0 and populates "pArchive".  Returns nonzero errno
  * value on failure.
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive, like mzOpenZipArchive(), with the help of a
+ * persistent index of its central directory.
+ *
+ * If "indexFileName" holds an index that matches the archive (same size,
+ * mtime, ctime and end-of-central-directory record), the entries are
+ * taken from it instead of parsing the central directory.  Otherwise the
+ * archive is parsed as usual and a fresh index is written to
+ * "indexFileName"; failing to write it is not an error.
+ *
+ * The index is trusted once it matches, so "indexFileName" must be in a
+ * location that only recovery can write to.  Passing a NULL indexFileName
+ * is the same as calling mzOpenZipArchive().
+ */
+int mzOpenZipArchiveWithIndex(const char* fileName,
+        const char* indexFileName, ZipArchive* pArchive);
+
+/*
+ * Open an archive image that is already in memory, such as one embedded
+ * in another file.  The image is used in place, so it must stay valid
+ * and unchanged until the archive is closed.
+ *
+ * Returns 0 on success, nonzero on failure.
+ */
+int mzOpenZipArchiveFromMemory(const void* addr, size_t length,
+        ZipArchive* pArchive);
+
+/*
+ * Open a STORED entry of "pParent" as an archive of its own, without
+ * extracting it.  If the entry is part of the parent's mapping it is
+ * parsed right there, so "pParent" must stay open until the nested
+ * archive is closed; otherwise just the entry is mapped.
+ *
+ * Returns 0 on success, nonzero on failure (including for compressed
+ * entries).
+ */
+int mzOpenZipArchiveFromEntry(const ZipArchive* pParent,
+        const ZipEntry* pEntry, ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -78,6 +143,13 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Same, for a name of "nameLen" bytes that needn't be NUL-terminated,
+ * e.g. one pointing into a buffer being parsed.
+ */
+const ZipEntry* mzFindZipEntryN(const ZipArchive* pArchive,
+        const char* entryName, unsigned int nameLen);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -105,6 +177,39 @@ mzGetZipEntryIndex(const ZipArchive *pArchive, const ZipEntry *pEntry) {
     return pEntry - pArchive->pEntries;
 }
 
+/*
+ * Iterate over all entries whose names start with a given prefix, in
+ * sorted order.  Finding the first entry is a binary search, so walking
+ * a small directory of a huge archive only costs O(log n + matches).
+ *
+ * Use like this:
+ *   ZipEntryIter iter;
+ *   for (mzZipEntryIterBegin(pArchive, "system/app/", &iter);
+ *       !mzZipEntryIterDone(&iter); mzZipEntryIterNext(&iter))
+ *   {
+ *       const ZipEntry* pEntry = mzZipEntryIterEntry(&iter);
+ *   }
+ *
+ * The prefix is matched byte for byte; pass "dir/" rather than "dir" to
+ * avoid also matching "directory".  An empty prefix matches everything.
+ */
+typedef struct ZipEntryIter {
+    const ZipArchive* pArchive;
+    unsigned int idx;
+    unsigned int end;
+} ZipEntryIter;
+void mzZipEntryIterBegin(const ZipArchive* pArchive, const char* prefix,
+        ZipEntryIter* pIter);
+INLINE bool mzZipEntryIterDone(const ZipEntryIter* pIter) {
+    return pIter->idx >= pIter->end;
+}
+INLINE void mzZipEntryIterNext(ZipEntryIter* pIter) {
+    pIter->idx++;
+}
+INLINE const ZipEntry* mzZipEntryIterEntry(const ZipEntryIter* pIter) {
+    return pIter->pArchive->pEntries + pIter->idx;
+}
+
 /*
  * Simple accessors.
  */
@@ -114,10 +219,7 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
-    return pEntry->offset;
-}
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -128,6 +230,14 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
+/*
+ * Get the file offset of the entry's data.  The local file header isn't
+ * read when the archive is opened, so this has to look at it; returns -1
+ * if the header turns out to be corrupt.
+ */
+long long mzGetZipEntryOffset(const ZipArchive* pArchive,
+        const ZipEntry* pEntry);
+
 
 /*
  * Type definition for the callback function used by
@@ -150,12 +260,120 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Raw access to the bytes of the archive file itself, e.g. to check a
+ * signature over the whole file.  mzProcessZipArchiveRange() passes
+ * [offset, offset+len) to processFunction a piece at a time, straight
+ * from memory-mapped data; mzReadZipArchiveRange() copies a (small) range
+ * into "buf".  Both return false if the range isn't inside the file.
+ */
+INLINE long long mzGetZipArchiveLength(const ZipArchive* pArchive) {
+    return pArchive->fileLength;
+}
+bool mzProcessZipArchiveRange(const ZipArchive* pArchive, long long offset,
+    long long len, ProcessZipEntryContentsFunction processFunction,
+    void* cookie);
+bool mzReadZipArchiveRange(const ZipArchive* pArchive, long long offset,
+    void* buf, size_t count);
+
+/*
+ * Get the file offset of the central directory, which with the EOCD
+ * record and comment after it runs to the end of the file.
+ */
+bool mzGetZipArchiveDirectoryOffset(const ZipArchive* pArchive,
+    long long* pOffset);
+
+/*
+ * Get a pointer to the contents of a STORED entry without copying them.
+ * The data points into the archive's memory mapping, and remains valid
+ * until the archive is closed.
+ *
+ * Returns false (and leaves "pData" and "pLength" alone) if the entry
+ * is compressed, or if the archive is too large to be mapped whole and
+ * the entry's data isn't part of the mapping; use
+ * mzProcessZipEntryContents() for those.
+ */
+bool mzGetZipEntryData(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        const unsigned char** pData, size_t* pLength);
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char* buf, int bufLen);
 
+/*
+ * Random access to the contents of large DEFLATED entries.
+ *
+ * Deflate streams can only be decoded from the start, so reading a range
+ * out of the middle of an entry normally means inflating everything that
+ * precedes it.  A seek index remembers where to restart inflate (plus the
+ * 32K of history it needs) about every "span" bytes of uncompressed data;
+ * with one attached to the archive, mzReadZipEntryRange() only inflates
+ * from the checkpoint nearest to the range.  Each checkpoint costs 32K of
+ * memory, so pick "span" with the size of the entry in mind.
+ *
+ * mzBuildZipSeekIndex() inflates the whole entry once.  If processFunction
+ * is non-NULL it is called with the uncompressed data along the way, as
+ * with mzProcessZipEntryContents(), so the pass that builds the index can
+ * also check or copy the data.  Returns NULL on failure.
+ *
+ * An index can be saved next to the archive with mzWriteZipSeekIndex() and
+ * loaded again with mzReadZipSeekIndex(), which returns NULL if the file
+ * doesn't belong to "pEntry".  The windows in the file can't be checked,
+ * so it must live somewhere that only recovery can write to.
+ *
+ * mzAddZipSeekIndex() hands an index over to the archive, which frees it
+ * in mzCloseZipArchive().  Attach indexes before sharing the archive with
+ * other threads.  Indexes that were never attached are released with
+ * mzFreeZipSeekIndex().
+ */
+typedef struct ZipSeekIndex ZipSeekIndex;
+ZipSeekIndex* mzBuildZipSeekIndex(const ZipArchive* pArchive,
+        const ZipEntry* pEntry, long span,
+        ProcessZipEntryContentsFunction processFunction, void* cookie);
+bool mzWriteZipSeekIndex(const ZipSeekIndex* pIndex, const char* fileName);
+ZipSeekIndex* mzReadZipSeekIndex(const ZipEntry* pEntry,
+        const char* fileName);
+void mzAddZipSeekIndex(ZipArchive* pArchive, ZipSeekIndex* pIndex);
+void mzFreeZipSeekIndex(ZipSeekIndex* pIndex);
+
+/*
+ * Read "len" bytes of the entry's uncompressed data, starting at "offset",
+ * into "buf".  Works for STORED entries too, which are simply copied.
+ * Without a seek index for the entry, DEFLATED entries are inflated from
+ * the start.
+ */
+bool mzReadZipEntryRange(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        long long offset, size_t len, unsigned char* buf);
+
+/*
+ * Process an archive that can only be read front to back, such as one
+ * arriving on a pipe or a socket, without staging it in a file first.
+ *
+ * The entries are described by their local file headers, in the order
+ * they appear.  For each one, entryFunction is called with a ZipEntry
+ * that is only valid during the call.  To receive the uncompressed data,
+ * it sets *pProcessFunction and *pProcessCookie, which are used as with
+ * mzProcessZipEntryContents(); leaving *pProcessFunction NULL skips the
+ * entry.  Returning false abandons the stream.
+ *
+ * Local headers don't carry the file attributes, so no entry is a
+ * symlink.  If the entry's sizes and CRC trail its data (general purpose
+ * bit 3), compLen, uncompLen and crc32 are zero when entryFunction sees
+ * them.  STORED entries with trailing sizes can't be streamed.
+ *
+ * Data is handed to processFunction as it arrives, before its CRC can be
+ * checked; a bad CRC makes mzProcessZipStream() fail once the entry ends.
+ * Reading stops at the central directory, which is left unread.  Returns
+ * true if every entry up to there was processed successfully.
+ */
+typedef bool (*ProcessZipStreamEntryFunction)(const ZipEntry* pEntry,
+    ProcessZipEntryContentsFunction* pProcessFunction, void** pProcessCookie,
+    void* cookie);
+bool mzProcessZipStream(int fd, ProcessZipStreamEntryFunction entryFunction,
+    void* cookie);
+
 /*
  * Check the CRC on this entry; return true if it is correct.
  * May do other internal checks as well.
@@ -168,6 +386,17 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
 
+/*
+ * Like mzExtractZipEntryToFile(), but block-aligned runs of zeros are
+ * left as holes rather than written: skipped past the old end of the
+ * file, and punched out of any data it already had.  The file ends up
+ * with the same contents, positioned after the entry, with less written
+ * to flash.  Falls back to writing everything if "fd" isn't a regular
+ * file.
+ */
+bool mzExtractZipEntryToSparseFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -190,14 +419,30 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - inflate and write files on a pool of worker
+ *         threads, one per CPU; directories and symlinks are still made
+ *         on the calling thread, in archive order.  Falls back to a serial
+ *         extraction if names repeat or an entry lies under a file or
+ *         symlink entry, where the order of operations matters
+ *     MZ_EXTRACT_SPARSE - leave holes for whole blocks of zeros, with
+ *         mzExtractZipEntryToSparseFile()
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
+ * Even with MZ_EXTRACT_PARALLEL, the callback is only ever invoked on the
+ * calling thread, in archive order, once the file has been written.
  *
- * Returns true on success, false on failure.
+ * Returns true on success, false on failure.  On failure the callback
+ * has been invoked for exactly the entries that precede the first one
+ * that failed.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_PARALLEL = 4,
+    MZ_EXTRACT_SPARSE = 8,
+};
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Benchmark for opening an archive with many entries: writes a synthetic
+ * STORED archive whose central directory is in random order, then times
+ * mzOpenZipArchive() on it and checks that every entry can be found.
+ *
+ *     minzip_zip_bench [entries [runs]]
+ *
+ * The default is 50,000 entries, named system/app/dNNN/fileNNNNNNN.txt,
+ * opened 5 times.  The archive is written to $TMPDIR (or /tmp) and
+ * removed afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Zip.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char* put2(unsigned char* p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static unsigned char* put4(unsigned char* p, unsigned long v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static void entryName(char* buf, size_t len, unsigned int i)
+{
+    snprintf(buf, len, "system/app/d%03u/file%07u.txt", i % 1000, i);
+}
+
+/*
+ * Write an archive of "numEntries" empty files to "fd".  The local
+ * headers are in name order, the central directory in random order.
+ */
+static int writeArchive(int fd, unsigned int numEntries)
+{
+    enum { NAME_MAX_LEN = 64, LOCHDR = 30, CENHDR = 46, ENDHDR = 22 };
+    unsigned long* offsets;
+    unsigned int* order;
+    unsigned char* buf;
+    unsigned char* p;
+    unsigned char* cdStart;
+    unsigned long cdLen;
+    char name[NAME_MAX_LEN];
+    unsigned int i, nameLen;
+    int result = -1;
+
+    offsets = (unsigned long*) malloc(numEntries * sizeof(*offsets));
+    order = (unsigned int*) malloc(numEntries * sizeof(*order));
+    buf = (unsigned char*) malloc((size_t) numEntries *
+            (LOCHDR + CENHDR + 2 * NAME_MAX_LEN) + ENDHDR);
+    if (offsets == NULL || order == NULL || buf == NULL) {
+        fprintf(stderr, "can't allocate %u entries\n", numEntries);
+        goto bail;
+    }
+
+    p = buf;
+    for (i = 0; i < numEntries; i++) {
+        entryName(name, sizeof(name), i);
+        nameLen = strlen(name);
+        offsets[i] = p - buf;
+        p = put4(p, 0x04034b50);
+        p = put2(p, 10);            // version needed
+        p = put2(p, 0);             // flags
+        p = put2(p, 0);             // STORED
+        p = put4(p, 0);             // time and date
+        p = put4(p, 0);             // CRC-32
+        p = put4(p, 0);             // compressed size
+        p = put4(p, 0);             // uncompressed size
+        p = put2(p, nameLen);
+        p = put2(p, 0);             // extra length
+        memcpy(p, name, nameLen);
+        p += nameLen;
+    }
+
+    srand(1);
+    for (i = 0; i < numEntries; i++) {
+        order[i] = i;
+    }
+    for (i = numEntries; i > 1; i--) {
+        unsigned int j = rand() % i;
+        unsigned int tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+
+    cdStart = p;
+    for (i = 0; i < numEntries; i++) {
+        entryName(name, sizeof(name), order[i]);
+        nameLen = strlen(name);
+        p = put4(p, 0x02014b50);
+        p = put2(p, 10);            // version made by
+        p = put2(p, 10);            // version needed
+        p = put2(p, 0);             // flags
+        p = put2(p, 0);             // STORED
+        p = put4(p, 0);             // time and date
+        p = put4(p, 0);             // CRC-32
+        p = put4(p, 0);             // compressed size
+        p = put4(p, 0);             // uncompressed size
+        p = put2(p, nameLen);
+        p = put2(p, 0);             // extra length
+        p = put2(p, 0);             // comment length
+        p = put2(p, 0);             // disk number
+        p = put2(p, 0);             // internal attributes
+        p = put4(p, 0);             // external attributes
+        p = put4(p, offsets[order[i]]);
+        memcpy(p, name, nameLen);
+        p += nameLen;
+    }
+
+    cdLen = p - cdStart;
+    p = put4(p, 0x06054b50);
+    p = put2(p, 0);                 // this disk
+    p = put2(p, 0);                 // central directory disk
+    p = put2(p, numEntries);
+    p = put2(p, numEntries);
+    p = put4(p, cdLen);
+    p = put4(p, cdStart - buf);
+    p = put2(p, 0);                 // comment length
+
+    if (write(fd, buf, p - buf) != p - buf) {
+        perror("write");
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    free(offsets);
+    free(order);
+    free(buf);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int numEntries = argc > 1 ? atoi(argv[1]) : 50000;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    const char* tmpDir = getenv("TMPDIR");
+    char fileName[256];
+    char name[64];
+    double start, best = 0;
+    int fd, run, result = 1;
+    unsigned int i;
+
+    /* The EOCD only has 16 bits for the count; this doesn't do Zip64.
+     */
+    if (numEntries == 0 || numEntries > 65535 || runs <= 0) {
+        fprintf(stderr, "usage: %s [entries (1-65535) [runs]]\n", argv[0]);
+        return 2;
+    }
+    snprintf(fileName, sizeof(fileName), "%s/minzip_bench_XXXXXX",
+            tmpDir != NULL ? tmpDir : "/tmp");
+    fd = mkstemp(fileName);
+    if (fd < 0) {
+        perror(fileName);
+        return 1;
+    }
+    if (writeArchive(fd, numEntries) != 0) {
+        goto bail;
+    }
+
+    for (run = 0; run < runs; run++) {
+        ZipArchive archive;
+        double secs;
+
+        start = now();
+        if (mzOpenZipArchive(fileName, &archive) != 0) {
+            fprintf(stderr, "can't open %s\n", fileName);
+            goto bail;
+        }
+        secs = now() - start;
+        if (run == 0 || secs < best) {
+            best = secs;
+        }
+
+        if (mzZipEntryCount(&archive) != numEntries) {
+            printf("%u entries, expected %u\n",
+                    mzZipEntryCount(&archive), numEntries);
+            mzCloseZipArchive(&archive);
+            goto bail;
+        }
+        for (i = 0; i < numEntries; i++) {
+            entryName(name, sizeof(name), i);
+            if (mzFindZipEntry(&archive, name) == NULL) {
+                printf("can't find %s\n", name);
+                mzCloseZipArchive(&archive);
+                goto bail;
+            }
+        }
+        mzCloseZipArchive(&archive);
+    }
+    printf("mzOpenZipArchive: %u entries in %.1f ms (best of %d)\n",
+            numEntries, best * 1e3, runs);
+    result = 0;
+
+bail:
+    close(fd);
+    unlink(fileName);
+    return result;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host test for the whole-file signature check in verifier.c.  Exits
+ * with status 0 if every case passes:
+ *
+ *     verifier_test
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "verifier.h"
+
+/* A throwaway 2048-bit key (e = 3), used for nothing but these tests.
+ */
+static const RSAPublicKey test_key = {
+    RSANUMWORDS,
+    0xf82a84c3,
+    {
+        0xc98eb415, 0x59eb5a6e, 0xfc1a8bf2, 0xfaa6462b,
+        0x2692ef79, 0x9f656dec, 0xdee1ea15, 0xe9eac045,
+        0xcc8df9c7, 0x72e7209f, 0x01a1e631, 0x644d6bcb,
+        0x19fac641, 0x2a8e8bba, 0xd706b4e9, 0xc0635207,
+        0x6e21dc4b, 0xd3363d42, 0x3ff201bb, 0x0ea00f58,
+        0xc6ca069d, 0x8708566c, 0x10d95a02, 0xb3beaa2a,
+        0x90b21f9d, 0xa08bcb8b, 0xe7ebf57d, 0xb602e532,
+        0x7b5badf7, 0x6726c4f8, 0x025d0eff, 0xf5901050,
+        0x26b85fe9, 0x7ca69980, 0xd6dc29d7, 0x7567375e,
+        0x5d464a0c, 0x73e57bb2, 0x6679d05f, 0x7c344d9f,
+        0xd028941e, 0x2d3e7b01, 0xb3ead587, 0x9cbe0ddc,
+        0x7b69e6fb, 0x8329057f, 0x961d59e0, 0xec4e078d,
+        0xd56520e1, 0x397f7a9e, 0xf2acb61d, 0x5297d096,
+        0x0a4b18cc, 0x38135ca0, 0x7164bdde, 0xcb767527,
+        0xfc46213b, 0xc3fca992, 0x7b8a1abd, 0x74336662,
+        0xa2fdc791, 0x94057a6f, 0x69d4f483, 0xed5eab42,
+    },
+    {
+        0xdb8ae7fd, 0x432c85ba, 0x26cbd932, 0xe3a4eea4,
+        0xc5604fa5, 0x1226923b, 0x76d84b4f, 0xaa401790,
+        0xbf968047, 0xf6449c44, 0xf3d6f248, 0x42630ffd,
+        0x1c99e7a5, 0x935920f8, 0xe01af37a, 0xd6fdd14d,
+        0xd0077f92, 0xbadf4573, 0x651556ea, 0xa42098a9,
+        0x520124df, 0xcee52fd9, 0xe7c15c0b, 0xd68e1108,
+        0x730a7ec3, 0x4ca25956, 0xd79ca339, 0xef43aaf8,
+        0xf5686d72, 0x7e633285, 0x608c56b1, 0xd7c9ad08,
+        0x573e7755, 0x7cd9e159, 0x7629ea71, 0x746e1809,
+        0x881ef0b6, 0x25f1fa77, 0xc9724ff9, 0x2b5bfced,
+        0x710ce469, 0x29a03476, 0x441ed04c, 0x6f2b1500,
+        0x54bf6af1, 0xa5b65536, 0xf36e7951, 0x9bc504ab,
+        0xc9a9923b, 0xc89cfb73, 0x23b68d59, 0x9a5c510a,
+        0xab885a7b, 0xd61ac202, 0x61b3802e, 0xe3f285f3,
+        0x3d557cd0, 0x786360e4, 0xfa6a1db2, 0x0a27be32,
+        0xd0f24619, 0xfcb65588, 0xa185b6bf, 0xbb8aeb54,
+    }
+};
+
+/* A package with one STORED entry, "a", up to the comment length field
+ * of its EOCD record: everything a whole-file signature covers.
+ */
+static const unsigned char signed_part[] = {
+    0x50, 0x4b, 0x03, 0x04, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x43, 0xbe, 0xb7, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x61, 0x61, 0x50, 0x4b, 0x01, 0x02,
+    0x0a, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x43, 0xbe, 0xb7, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x61, 0x50, 0x4b, 0x05, 0x06, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x2f, 0x00, 0x00, 0x00, 0x20,
+    0x00, 0x00, 0x00,
+};
+
+/* test_key's signature over signed_part.
+ */
+static const unsigned char signature[RSANUMBYTES] = {
+    0x2e, 0x9d, 0x98, 0xab, 0x85, 0xc6, 0x34, 0x9d, 0xb8, 0x7c, 0x42, 0x4c,
+    0x5e, 0xaa, 0x22, 0x50, 0x65, 0xcc, 0xaf, 0xac, 0x83, 0x47, 0x13, 0xb1,
+    0x41, 0x31, 0xef, 0x2a, 0xd9, 0x22, 0x17, 0x96, 0xb0, 0x4d, 0x08, 0x9e,
+    0x4c, 0xc3, 0x30, 0x02, 0xf6, 0x97, 0x77, 0x76, 0x44, 0x48, 0x0d, 0xcb,
+    0x36, 0xed, 0x36, 0x70, 0xb8, 0x57, 0x0a, 0xba, 0xb7, 0x49, 0x61, 0x5e,
+    0x54, 0xe6, 0x44, 0xff, 0xf2, 0x8f, 0x5a, 0x68, 0xe7, 0x77, 0x96, 0xa3,
+    0x51, 0xae, 0x58, 0xd9, 0x2a, 0x2b, 0xaa, 0x46, 0x41, 0x34, 0xd0, 0xe1,
+    0xbb, 0x6b, 0x17, 0x6a, 0x70, 0x8f, 0x64, 0xd1, 0x99, 0x50, 0x63, 0xde,
+    0xb1, 0xc6, 0x67, 0x4b, 0xe5, 0xbf, 0xdf, 0x83, 0x59, 0x0a, 0x91, 0x30,
+    0x99, 0x44, 0x76, 0xe2, 0x2e, 0x4a, 0xfb, 0x41, 0x1c, 0x1d, 0x84, 0xac,
+    0x35, 0x72, 0xc2, 0x7c, 0xbf, 0x29, 0xa1, 0xa7, 0x9a, 0xce, 0xef, 0x4a,
+    0x26, 0x2a, 0x11, 0xa5, 0x05, 0xb6, 0x93, 0x38, 0x99, 0x07, 0xf2, 0x74,
+    0x9c, 0x92, 0xc8, 0x43, 0xc7, 0xf7, 0x7f, 0xe4, 0x33, 0xd6, 0x43, 0x96,
+    0x3d, 0xeb, 0x6c, 0xca, 0x94, 0x3c, 0x45, 0x98, 0x91, 0xbf, 0x41, 0x8a,
+    0x2c, 0xa6, 0x4e, 0x6f, 0x5a, 0x10, 0xad, 0x72, 0xf5, 0xd8, 0xd8, 0xd9,
+    0xd9, 0x26, 0xf7, 0x7a, 0xaf, 0x2b, 0x95, 0x91, 0xb2, 0x0c, 0xe0, 0xab,
+    0x8a, 0x72, 0x3c, 0xec, 0x82, 0x43, 0x87, 0x12, 0x20, 0xbc, 0x89, 0xcc,
+    0x97, 0x9a, 0x36, 0xd5, 0x03, 0x1a, 0xfa, 0x5c, 0xde, 0x69, 0xdc, 0x7d,
+    0xdf, 0x53, 0x67, 0xba, 0xd4, 0x2f, 0xff, 0xbb, 0xe0, 0x80, 0xb3, 0xed,
+    0x77, 0x0b, 0xde, 0xd3, 0xbf, 0xc5, 0xea, 0x76, 0x7f, 0xac, 0xf0, 0x64,
+    0x86, 0x92, 0xce, 0xf3, 0xbf, 0xf0, 0xa7, 0x71, 0x75, 0xa4, 0x79, 0xef,
+    0x59, 0x89, 0x04, 0xab,
+};
+
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
+#define MAX_TEXT 64
+
+/* verifier.c reports through the recovery UI; send that to stderr.
+ */
+void
+ui_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void
+ui_set_progress(float fraction)
+{
+}
+
+static unsigned char package[sizeof(signed_part) + 2 + MAX_TEXT +
+        RSANUMBYTES + FOOTER_SIZE];
+
+/* Build a package in package[] with a comment of "textLen" bytes of
+ * "text", the signature and a footer whose signature start is "start"
+ * and whose comment length is off from the real one by "lengthSkew".
+ * Returns its size.
+ */
+static size_t
+build_package(const void *text, unsigned textLen, unsigned start,
+        int lengthSkew)
+{
+    unsigned commentLen = textLen + RSANUMBYTES + FOOTER_SIZE;
+    unsigned footerLen = commentLen + lengthSkew;
+    unsigned char *p = package;
+
+    memcpy(p, signed_part, sizeof(signed_part));
+    p += sizeof(signed_part);
+    *p++ = commentLen & 0xff;
+    *p++ = commentLen >> 8;
+    memcpy(p, text, textLen);
+    p += textLen;
+    memcpy(p, signature, RSANUMBYTES);
+    p += RSANUMBYTES;
+    *p++ = start & 0xff;
+    *p++ = start >> 8;
+    *p++ = 0xff;
+    *p++ = 0xff;
+    *p++ = footerLen & 0xff;
+    *p++ = footerLen >> 8;
+    return p - package;
+}
+
+/* Returns 1 if the package verifies, 0 if it is rejected, either by the
+ * verifier or because it doesn't even open.
+ */
+static int
+verify_package(size_t length)
+{
+    ZipArchive zip;
+    if (mzOpenZipArchiveFromMemory(package, length, &zip) != 0) return 0;
+    bool ok = verify_whole_file_signature(&zip, &test_key, 1);
+    mzCloseZipArchive(&zip);
+    return ok ? 1 : 0;
+}
+
+static int
+test_verifier()
+{
+    static const char text[] = "signed by test";
+    const unsigned good = RSANUMBYTES + FOOTER_SIZE;
+    size_t length;
+
+    /* A well-formed footer verifies, with or without text before the
+     * signature.
+     */
+    if (verify_package(build_package("", 0, good, 0)) != 1) return -__LINE__;
+    length = build_package(text, sizeof(text) - 1, good, 0);
+    if (verify_package(length) != 1) return -__LINE__;
+
+    /* Any other signature start is rejected, even one that still lies
+     * inside the comment.
+     */
+    length = build_package(text, sizeof(text) - 1, good + 4, 0);
+    if (verify_package(length) != 0) return -__LINE__;
+    length = build_package(text, sizeof(text) - 1, good - 1, 0);
+    if (verify_package(length) != 0) return -__LINE__;
+    if (verify_package(build_package("", 0, 0, 0)) != 0) return -__LINE__;
+
+    /* A byte changed anywhere in the signed part is caught.
+     */
+    length = build_package(text, sizeof(text) - 1, good, 0);
+    package[sizeof(signed_part) / 2] ^= 0x01;
+    if (verify_package(length) != 0) return -__LINE__;
+
+    /* The footer's comment length has to agree with the EOCD's.
+     */
+    length = build_package(text, sizeof(text) - 1, good, -1);
+    if (verify_package(length) != 0) return -__LINE__;
+    length = build_package(text, sizeof(text) - 1, good, 1);
+    if (verify_package(length) != 0) return -__LINE__;
+
+    /* No second EOCD record may hide in the comment.  This one is a copy
+     * of the real record, resized to end where the file does, so zip
+     * readers pick it and the package still opens.
+     */
+    unsigned char eocd[EOCD_HEADER_SIZE];
+    memcpy(eocd, signed_part + sizeof(signed_part) - (EOCD_HEADER_SIZE - 2),
+            EOCD_HEADER_SIZE - 2);
+    eocd[EOCD_HEADER_SIZE - 2] = good & 0xff;
+    eocd[EOCD_HEADER_SIZE - 1] = good >> 8;
+    length = build_package(eocd, sizeof(eocd), good, 0);
+    if (verify_package(length) != 0) return -__LINE__;
+
+    return 0;
+}
+
+int
+main()
+{
+    int ret = test_verifier();
+    if (ret != 0) {
+        fprintf(stderr, "verifier_test: failed at line %d\n", -ret);
+        return 1;
+    }
+    printf("verifier_test: passed\n");
+    return 0;
+}
@@ -21,6 +21,12 @@ LOCAL_SRC_FILES := $(updater_src_files)
 LOCAL_STATIC_LIBRARIES := libapplypatch libedify libmtdutils libminzip libz
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
+ifeq ($(MINZIP_USE_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(MINZIP_USE_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 LOCAL_MODULE := updater
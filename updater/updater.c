@@ -27,6 +27,10 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Central directory index left behind by recovery when it opened the
+// same package, so we don't have to parse it all over again.
+#define PACKAGE_INDEX_FILE "/tmp/update_package.idx"
+
 int main(int argc, char** argv) {
     if (argc != 4) {
         fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
@@ -52,7 +56,7 @@ int main(int argc, char** argv) {
     char* package_data = argv[3];
     ZipArchive za;
     int err;
-    err = mzOpenZipArchive(package_data, &za);
+    err = mzOpenZipArchiveWithIndex(package_data, PACKAGE_INDEX_FILE, &za);
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
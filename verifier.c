@@ -17,13 +17,23 @@
 #include "common.h"
 #include "verifier.h"
 
+#include "minzip/Checksum.h"
 #include "minzip/Zip.h"
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>  /* required for resolv.h */
+#include <pthread.h>
 #include <resolv.h>      /* for base64 codec */
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Return an allocated buffer with the contents of a zip file entry. */
 static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
@@ -53,42 +63,209 @@ static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
 }
 
 
+/* An incremental parser for manifests and signature files, fed straight
+ * from the archive a chunk at a time.  Lines may end in CR, LF or CRLF,
+ * blank lines are skipped, and a line starting with a space continues
+ * the one before it.  Each whole line is passed to the callback without
+ * its line ending, NUL-terminated, in a buffer that is reused for the
+ * next line; the callback returns false to stop parsing.  Lines longer
+ * than any name we could use are dropped, which leaves their entries
+ * without a digest. */
+#define MANIFEST_LINE_MAX (PATH_MAX + 64)
+
+typedef bool (*ManifestLineFunc)(char *line, size_t len, void *cookie);
+
+struct ManifestParser {
+    ManifestLineFunc func;
+    void *cookie;
+    char line[MANIFEST_LINE_MAX + 1];
+    size_t len;
+    bool haveLine;     // line[] holds a line that may still be continued
+    bool atLineStart;  // the next byte starts a physical line
+    bool afterCR;      // an LF next is the rest of a CRLF
+    bool tooLong;      // dropping the rest of this line
+    bool failed;       // stopped by the callback
+};
+
+static void initManifestParser(struct ManifestParser *parser,
+        ManifestLineFunc func, void *cookie) {
+    parser->func = func;
+    parser->cookie = cookie;
+    parser->len = 0;
+    parser->haveLine = false;
+    parser->atLineStart = true;
+    parser->afterCR = false;
+    parser->tooLong = false;
+    parser->failed = false;
+}
+
+static void emitManifestLine(struct ManifestParser *parser) {
+    if (!parser->haveLine) return;
+    parser->haveLine = false;
+    if (parser->tooLong) {
+        LOGW("Skipping manifest line over %d bytes\n", MANIFEST_LINE_MAX);
+        parser->tooLong = false;
+        return;
+    }
+    parser->line[parser->len] = '\0';
+    if (!parser->func(parser->line, parser->len, parser->cookie)) {
+        parser->failed = true;
+    }
+}
+
+static bool feedManifestParser(struct ManifestParser *parser,
+        const unsigned char *data, size_t len) {
+    while (len > 0 && !parser->failed) {
+        if (parser->afterCR) {
+            parser->afterCR = false;
+            if (*data == '\n') {
+                ++data;
+                --len;
+                continue;
+            }
+        }
+
+        if (parser->atLineStart) {
+            if (*data == '\r' || *data == '\n') {
+                // A blank line.
+                emitManifestLine(parser);
+                parser->afterCR = (*data == '\r');
+                ++data;
+                --len;
+                continue;
+            }
+
+            parser->atLineStart = false;
+            if (*data == ' ' && parser->haveLine) {
+                // Join a continuation onto the line before.
+                ++data;
+                --len;
+                continue;
+            }
+
+            emitManifestLine(parser);
+            if (parser->failed) break;
+            parser->haveLine = true;
+            parser->len = 0;
+        }
+
+        size_t n = 0;
+        while (n < len && data[n] != '\r' && data[n] != '\n') ++n;
+        if (parser->len + n > MANIFEST_LINE_MAX) parser->tooLong = true;
+        if (!parser->tooLong) {
+            memcpy(parser->line + parser->len, data, n);
+            parser->len += n;
+        }
+        data += n;
+        len -= n;
+
+        if (len > 0) {
+            parser->afterCR = (*data == '\r');
+            parser->atLineStart = true;
+            ++data;
+            --len;
+        }
+    }
+    return !parser->failed;
+}
+
+/* Pass on the last line, which needn't have a line ending. */
+static bool finishManifestParser(struct ManifestParser *parser) {
+    if (!parser->failed) emitManifestLine(parser);
+    return !parser->failed;
+}
+
+
+struct VerifyPool;
+
 struct DigestContext {
-    SHA_CTX digest;
-    unsigned *doneBytes;
-    unsigned totalBytes;
+    MzSha1Context digest;
+    unsigned long *crc;       // CRC-32 to compute as well, or NULL
+    struct VerifyPool *pool;  // for progress and early abort, or NULL
+    unsigned jobIndex;
+    struct ManifestParser *parser;  // to parse the contents too, or NULL
+    bool abandoned;
+};
+
+
+/* The entries named in the manifest, checked by a pool of threads.
+ * Workers only record how each job went; the main thread waits for the
+ * jobs in manifest order, so failures are reported exactly as a serial
+ * check would report them, and it is the only thread that touches the
+ * UI. */
+enum {
+    JOB_PENDING, JOB_DONE, JOB_UNREADABLE, JOB_CORRUPT, JOB_WRONG,
+    JOB_ABANDONED
+};
+
+#define MAX_VERIFY_THREADS 8
+
+struct VerifyJob {
+    const ZipEntry *entry;
+    uint8_t expected[SHA_DIGEST_SIZE];
+    int state;
+};
+
+struct VerifyPool {
+    const ZipArchive *pArchive;
+    struct VerifyJob *jobs;  // room for every entry in the archive
+    unsigned numJobs;
+    unsigned nextJob;       // next job for a worker to claim
+    unsigned failedJob;     // lowest failed job so far, or numJobs
+    long long doneBytes;
+    pthread_mutex_t lock;
+    pthread_cond_t jobDone;
 };
 
 
-/* mzProcessZipEntryContents callback to update an SHA-1 hash context. */
+/* mzProcessZipEntryContents callback to update an SHA-1 hash context,
+ * and the CRC-32 and parser too if there are any. */
 static bool updateHash(const unsigned char *data, int dataLen, void *cookie) {
     struct DigestContext *context = (struct DigestContext *) cookie;
-    SHA_update(&context->digest, data, dataLen);
-    if (context->doneBytes != NULL) {
-        *context->doneBytes += dataLen;
-        if (context->totalBytes > 0) {
-            ui_set_progress(*context->doneBytes * 1.0 / context->totalBytes);
-        }
+    mzSha1Update(&context->digest, data, dataLen);
+    if (context->crc != NULL) {
+        *context->crc = mzCrc32(*context->crc, data, dataLen);
+    }
+    if (context->parser != NULL) {
+        // The digest is still needed if parsing stops early.
+        feedManifestParser(context->parser, data, dataLen);
+    }
+    if (context->pool != NULL) {
+        // Give up if an earlier job has already failed.
+        struct VerifyPool *pool = context->pool;
+        pthread_mutex_lock(&pool->lock);
+        pool->doneBytes += dataLen;
+        context->abandoned = context->jobIndex > pool->failedJob;
+        pthread_mutex_unlock(&pool->lock);
+        return !context->abandoned;
     }
     return true;
 }
 
 
-/* Get the SHA-1 digest of a zip file entry. */
+/* Get the SHA-1 digest of a zip file entry, doing whatever else the
+ * context asks for (CRC, parsing) in the same pass, so the entry only
+ * has to be decompressed once.  "context" may be NULL.  Read errors are
+ * left for the pool to report if the context belongs to one. */
 static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
-        unsigned *doneBytes, unsigned totalBytes,
-        uint8_t digest[SHA_DIGEST_SIZE]) {
-    struct DigestContext context;
-    SHA_init(&context.digest);
-    context.doneBytes = doneBytes;
-    context.totalBytes = totalBytes;
-    if (!mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context)) {
-        UnterminatedString fn = mzGetZipEntryFileName(pEntry);
-        LOGE("Can't digest %.*s\n", fn.len, fn.str);
+        struct DigestContext *context, uint8_t digest[SHA_DIGEST_SIZE]) {
+    struct DigestContext plain;
+    if (context == NULL) {
+        memset(&plain, 0, sizeof(plain));
+        context = &plain;
+    }
+    mzSha1Init(&context->digest);
+    if (context->crc != NULL) *context->crc = 0;
+    context->abandoned = false;
+    if (!mzProcessZipEntryContents(pArchive, pEntry, updateHash, context)) {
+        if (context->pool == NULL) {
+            UnterminatedString fn = mzGetZipEntryFileName(pEntry);
+            LOGE("Can't digest %.*s\n", fn.len, fn.str);
+        }
         return false;
     }
 
-    memcpy(digest, SHA_final(&context.digest), SHA_DIGEST_SIZE);
+    mzSha1Final(&context->digest, digest);
 
 #ifdef LOG_VERBOSE
     UnterminatedString fn = mzGetZipEntryFileName(pEntry);
@@ -101,9 +278,37 @@ static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
 }
 
 
-/* Find a /META-INF/xxx.SF signature file signed by a matching xxx.RSA file. */
+/* What we look for in a signature file. */
+struct SignatureFile {
+    const ZipEntry *sfEntry;
+    uint8_t mfDigest[SHA_DIGEST_SIZE + 3];
+    bool found;
+};
+
+/* ManifestLineFunc for a signature file: find the manifest digest. */
+static bool signatureLine(char *line, size_t len, void *cookie) {
+    static const char prefix[] = "SHA1-Digest-Manifest: ";
+    struct SignatureFile *sf = (struct SignatureFile *) cookie;
+
+    if (strncasecmp(prefix, line, sizeof(prefix) - 1)) return true;
+
+    const char *digest = line + sizeof(prefix) - 1;
+    int n = b64_pton(digest, sf->mfDigest, sizeof(sf->mfDigest));
+    if (n != SHA_DIGEST_SIZE) {
+        UnterminatedString fn = mzGetZipEntryFileName(sf->sfEntry);
+        LOGE("Invalid base64 in %.*s: %s (%d)\n", fn.len, fn.str, digest, n);
+    } else {
+        sf->found = true;
+    }
+    return false;  // only the first one counts
+}
+
+
+/* Find a /META-INF/xxx.SF signature file signed by a matching xxx.RSA file,
+ * and get the digest of the manifest from it. */
 static const ZipEntry *verifySignature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, unsigned int numKeys) {
+        const RSAPublicKey *pKeys, unsigned int numKeys,
+        uint8_t mfDigest[SHA_DIGEST_SIZE]) {
     static const char prefix[] = "META-INF/";
     static const char rsa[] = ".RSA", sf[] = ".SF";
 
@@ -135,8 +340,19 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
 
             free(sfName);
 
+            /* Digest the signature file and look for the manifest
+             * digest in it in the same pass. */
+            struct SignatureFile sfInfo;
+            struct ManifestParser parser;
+            struct DigestContext context;
             uint8_t sfDigest[SHA_DIGEST_SIZE];
-            if (!digestEntry(pArchive, sfEntry, NULL, 0, sfDigest)) continue;
+            sfInfo.sfEntry = sfEntry;
+            sfInfo.found = false;
+            initManifestParser(&parser, signatureLine, &sfInfo);
+            memset(&context, 0, sizeof(context));
+            context.parser = &parser;
+            if (!digestEntry(pArchive, sfEntry, &context, sfDigest)) continue;
+            finishManifestParser(&parser);
 
             char *rsaBuf = slurpEntry(pArchive, rsaEntry);
             if (rsaBuf == NULL) continue;
@@ -147,6 +363,11 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
                 if (RSA_verify(&pKeys[j], sig, RSANUMBYTES, sfDigest)) {
                     free(rsaBuf);
                     LOGI("Verified %.*s\n", rsaName.len, rsaName.str);
+                    if (!sfInfo.found) {
+                        LOGE("No digest manifest in signature file\n");
+                        return NULL;
+                    }
+                    memcpy(mfDigest, sfInfo.mfDigest, SHA_DIGEST_SIZE);
                     return sfEntry;
                 }
             }
@@ -161,72 +382,253 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
 }
 
 
-/* Verify /META-INF/MANIFEST.MF against the digest in a signature file. */
-static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
-        const ZipEntry *sfEntry) {
-    static const char prefix[] = "SHA1-Digest-Manifest: ", eol[] = "\r\n";
-    uint8_t expected[SHA_DIGEST_SIZE + 3], actual[SHA_DIGEST_SIZE];
-
-    char *sfBuf = slurpEntry(pArchive, sfEntry);
-    if (sfBuf == NULL) return NULL;
-
-    char *line, *save;
-    for (line = strtok_r(sfBuf, eol, &save); line != NULL;
-         line = strtok_r(NULL, eol, &save)) {
-        if (!strncasecmp(prefix, line, sizeof(prefix) - 1)) {
-            UnterminatedString fn = mzGetZipEntryFileName(sfEntry);
-            const char *digest = line + sizeof(prefix) - 1;
-            int n = b64_pton(digest, expected, sizeof(expected));
-            if (n != SHA_DIGEST_SIZE) {
-                LOGE("Invalid base64 in %.*s: %s (%d)\n",
-                        fn.len, fn.str, digest, n);
-                line = NULL;
-            }
-            break;
+/* The state of the manifest parse.  The first problem found is kept in
+ * error[] rather than logged at once, so that it is only reported if the
+ * manifest itself turns out to be genuine. */
+struct Manifest {
+    const ZipArchive *pArchive;
+    struct VerifyPool *pool;
+    bool *unverified;
+    char name[MANIFEST_LINE_MAX + 1];  // of the current stanza
+    size_t nameLen;
+    bool haveName;
+    char error[2 * MANIFEST_LINE_MAX];
+};
+
+/* ManifestLineFunc for the manifest: queue a job for each stanza. */
+static bool manifestLine(char *line, size_t len, void *cookie) {
+    static const char namePrefix[] = "Name: ";
+    static const char digestPrefix[] = "SHA1-Digest: ";
+    struct Manifest *mf = (struct Manifest *) cookie;
+
+    if (!strncasecmp(line, namePrefix, sizeof(namePrefix) - 1)) {
+        // "Name:" introducing a new stanza
+        if (mf->haveName) {
+            snprintf(mf->error, sizeof(mf->error),
+                    "No digest:\n  %s\n", mf->name);
+            return false;
+        }
+
+        mf->nameLen = len - (sizeof(namePrefix) - 1);
+        memcpy(mf->name, line + sizeof(namePrefix) - 1, mf->nameLen + 1);
+        mf->haveName = true;
+    } else if (line[0] == ' ') {
+        // Only the first line can't be joined to the one before
+        snprintf(mf->error, sizeof(mf->error),
+                "Unexpected continuation:\n  %s\n", line + 1);
+        return false;
+    } else if (!strncasecmp(line, digestPrefix, sizeof(digestPrefix) - 1)) {
+        // "Digest:" supplying a hash code for the current stanza
+        const char *base64 = line + sizeof(digestPrefix) - 1;
+        if (!mf->haveName) {
+            snprintf(mf->error, sizeof(mf->error),
+                    "Unexpected digest:\n  %s\n", base64);
+            return false;
         }
+
+        const ZipEntry *entry =
+                mzFindZipEntryN(mf->pArchive, mf->name, mf->nameLen);
+        if (entry == NULL) {
+            snprintf(mf->error, sizeof(mf->error),
+                    "Missing file:\n  %s\n", mf->name);
+            return false;
+        }
+        unsigned index = mzGetZipEntryIndex(mf->pArchive, entry);
+        if (!mf->unverified[index]) {
+            snprintf(mf->error, sizeof(mf->error),
+                    "Unexpected file:\n  %s\n", mf->name);
+            return false;
+        }
+
+        uint8_t expected[SHA_DIGEST_SIZE + 3];
+        int n = b64_pton(base64, expected, sizeof(expected));
+        if (n != SHA_DIGEST_SIZE) {
+            snprintf(mf->error, sizeof(mf->error),
+                    "Invalid base64:\n  %s\n  %s\n", mf->name, base64);
+            return false;
+        }
+
+        // Each entry is claimed only once, so the job list can't overflow.
+        struct VerifyJob *job = &mf->pool->jobs[mf->pool->numJobs++];
+        job->entry = entry;
+        memcpy(job->expected, expected, SHA_DIGEST_SIZE);
+        job->state = JOB_PENDING;
+        mf->unverified[index] = false;
+        mf->haveName = false;
     }
+    return true;
+}
+
 
-    free(sfBuf);
+/* Verify /META-INF/MANIFEST.MF against the digest from the signature
+ * file, parsing it into a list of jobs in the same pass. */
+static bool verifyManifest(const ZipArchive *pArchive,
+        const ZipEntry *sfEntry, const ZipEntry *mfEntry,
+        const uint8_t expected[SHA_DIGEST_SIZE], struct Manifest *mf) {
+    uint8_t actual[SHA_DIGEST_SIZE];
+    UnterminatedString mfName = mzGetZipEntryFileName(mfEntry);
 
-    if (line == NULL) {
-        LOGE("No digest manifest in signature file\n");
+    struct ManifestParser parser;
+    struct DigestContext context;
+    initManifestParser(&parser, manifestLine, mf);
+    memset(&context, 0, sizeof(context));
+    context.parser = &parser;
+    if (!digestEntry(pArchive, mfEntry, &context, actual)) return false;
+    if (memcmp(expected, actual, SHA_DIGEST_SIZE)) {
+        UnterminatedString fn = mzGetZipEntryFileName(sfEntry);
+        LOGE("Wrong digest for %.*s in %.*s\n",
+                mfName.len, mfName.str, fn.len, fn.str);
         return false;
     }
 
-    const char *mfName = "META-INF/MANIFEST.MF";
-    const ZipEntry *mfEntry = mzFindZipEntry(pArchive, mfName);
-    if (mfEntry == NULL) {
-        LOGE("No manifest file %s\n", mfName);
-        return NULL;
+    LOGI("Verified %.*s\n", mfName.len, mfName.str);
+
+    if (!finishManifestParser(&parser)) {
+        LOGE("%s", mf->error);
+        return false;
     }
+    return true;
+}
 
-    if (!digestEntry(pArchive, mfEntry, NULL, 0, actual)) return NULL;
-    if (memcmp(expected, actual, SHA_DIGEST_SIZE)) {
-        UnterminatedString fn = mzGetZipEntryFileName(sfEntry);
-        LOGE("Wrong digest for %s in %.*s\n", mfName, fn.len, fn.str);
-        return NULL;
+
+static void *verifyWorker(void *cookie) {
+    struct VerifyPool *pool = (struct VerifyPool *) cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nextJob < pool->numJobs && pool->nextJob < pool->failedJob) {
+        unsigned i = pool->nextJob++;
+        struct VerifyJob *job = &pool->jobs[i];
+        pthread_mutex_unlock(&pool->lock);
+
+        // One pass over the contents checks both the CRC and the digest.
+        uint8_t actual[SHA_DIGEST_SIZE];
+        unsigned long crc;
+        struct DigestContext context;
+        memset(&context, 0, sizeof(context));
+        context.crc = &crc;
+        context.pool = pool;
+        context.jobIndex = i;
+        int state = JOB_DONE;
+        if (!digestEntry(pool->pArchive, job->entry, &context, actual)) {
+            state = context.abandoned ? JOB_ABANDONED : JOB_UNREADABLE;
+        } else if (crc != (unsigned long) mzGetZipEntryCrc32(job->entry)) {
+            state = JOB_CORRUPT;
+        } else if (memcmp(job->expected, actual, SHA_DIGEST_SIZE) != 0) {
+            state = JOB_WRONG;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (state != JOB_DONE) {
+            if (i > pool->failedJob) {
+                state = JOB_ABANDONED;  // an earlier failure cut us short
+            } else {
+                pool->failedJob = i;
+            }
+        }
+        job->state = state;
+        pthread_cond_broadcast(&pool->jobDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/* Check all the queued jobs and report on them in order, stopping at
+ * the first failure.  Progress is updated a few times a second. */
+static bool runVerifyPool(struct VerifyPool *pool, long long totalBytes) {
+    pthread_t threads[MAX_VERIFY_THREADS];
+    unsigned numThreads, i;
+    bool ok = true;
+
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    numThreads = (numCpus > 0) ? (unsigned) numCpus : 1;
+    if (numThreads > MAX_VERIFY_THREADS) numThreads = MAX_VERIFY_THREADS;
+    if (numThreads > pool->numJobs) numThreads = pool->numJobs;
+
+    for (i = 0; i < numThreads; ++i) {
+        int err = pthread_create(&threads[i], NULL, verifyWorker, pool);
+        if (err != 0) {
+            LOGW("Can't start verify thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    numThreads = i;
+    if (numThreads == 0) {
+        // No threads at all; just do the work here.
+        verifyWorker(pool);
     }
 
-    LOGI("Verified %s\n", mfName);
-    return mfEntry;
+    for (i = 0; i < pool->numJobs; ++i) {
+        struct VerifyJob *job = &pool->jobs[i];
+        long long doneBytes;
+
+        pthread_mutex_lock(&pool->lock);
+        while (job->state == JOB_PENDING) {
+            struct timeval now;
+            struct timespec deadline;
+            gettimeofday(&now, NULL);
+            deadline.tv_sec = now.tv_sec;
+            deadline.tv_nsec = now.tv_usec * 1000 + 200 * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&pool->jobDone, &pool->lock, &deadline);
+
+            doneBytes = pool->doneBytes;
+            pthread_mutex_unlock(&pool->lock);
+            if (totalBytes > 0) ui_set_progress(doneBytes * 1.0 / totalBytes);
+            pthread_mutex_lock(&pool->lock);
+        }
+        int state = job->state;
+        doneBytes = pool->doneBytes;
+        pthread_mutex_unlock(&pool->lock);
+
+        UnterminatedString fn = mzGetZipEntryFileName(job->entry);
+        if (state == JOB_UNREADABLE) {
+            // As a serial check would: the read error, then the verdict.
+            LOGE("Can't digest %.*s\n", fn.len, fn.str);
+        }
+        if (state == JOB_UNREADABLE || state == JOB_CORRUPT) {
+            LOGE("Corrupt file:\n  %.*s\n", fn.len, fn.str);
+            ok = false;
+            break;
+        } else if (state != JOB_DONE) {
+            LOGE("Wrong digest:\n  %.*s\n", fn.len, fn.str);
+            ok = false;
+            break;
+        }
+
+        LOGI("Verified %.*s\n", fn.len, fn.str);
+        if (totalBytes > 0) ui_set_progress(doneBytes * 1.0 / totalBytes);
+    }
+
+    // Stop any work still in progress.
+    pthread_mutex_lock(&pool->lock);
+    pool->failedJob = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < numThreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    return ok;
 }
 
 
 /* Verify all the files in a Zip archive against the manifest. */
-static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
-    static const char namePrefix[] = "Name: ";
-    static const char contPrefix[] = " ";  // Continuation of the filename
-    static const char digestPrefix[] = "SHA1-Digest: ";
-    static const char eol[] = "\r\n";
-
-    char *mfBuf = slurpEntry(pArchive, mfEntry);
-    if (mfBuf == NULL) return false;
+static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *sfEntry,
+        const uint8_t mfDigest[SHA_DIGEST_SIZE]) {
+    const char *mfName = "META-INF/MANIFEST.MF";
+    const ZipEntry *mfEntry = mzFindZipEntry(pArchive, mfName);
+    if (mfEntry == NULL) {
+        LOGE("No manifest file %s\n", mfName);
+        return false;
+    }
 
     /* we're using calloc() here, so the initial state of the array is false */
     bool *unverified = (bool *) calloc(mzZipEntryCount(pArchive), sizeof(bool));
     if (unverified == NULL) {
         LOGE("Can't allocate valid flags\n");
-        free(mfBuf);
         return false;
     }
 
@@ -235,11 +637,12 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
      * At the end, we'll make sure that all the flags are unset.
      */
 
-    unsigned i, totalBytes = 0;
+    unsigned i;
+    long long totalBytes = 0;
     for (i = 0; i < mzZipEntryCount(pArchive); ++i) {
         const ZipEntry *entry = mzGetZipEntryAt(pArchive, i);
         UnterminatedString fn = mzGetZipEntryFileName(entry);
-        int len = mzGetZipEntryUncompLen(entry);
+        long long len = mzGetZipEntryUncompLen(entry);
 
         // Don't validate: directories, the manifest, *.RSA, and *.SF.
 
@@ -257,86 +660,53 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
         }
     }
 
-    unsigned doneBytes = 0;
-    char *line, *save, *name = NULL;
-    for (line = strtok_r(mfBuf, eol, &save); line != NULL;
-         line = strtok_r(NULL, eol, &save)) {
-        if (!strncasecmp(line, namePrefix, sizeof(namePrefix) - 1)) {
-            // "Name:" introducing a new stanza
-            if (name != NULL) {
-                LOGE("No digest:\n  %s\n", name);
-                break;
-            }
-
-            name = strdup(line + sizeof(namePrefix) - 1);
-            if (name == NULL) {
-                LOGE("Can't copy filename in %s\n", line);
-                break;
-            }
-        } else if (!strncasecmp(line, contPrefix, sizeof(contPrefix) - 1)) {
-            // Continuing a long name (nothing else should be continued)
-            const char *tail = line + sizeof(contPrefix) - 1;
-            if (name == NULL) {
-                LOGE("Unexpected continuation:\n  %s\n", tail);
-            }
-
-            char *concat;
-            if (asprintf(&concat, "%s%s", name, tail) < 0) {
-                LOGE("Can't append continuation %s\n", tail);
-                break;
-            }
-            free(name);
-            name = concat;
-        } else if (!strncasecmp(line, digestPrefix, sizeof(digestPrefix) - 1)) {
-            // "Digest:" supplying a hash code for the current stanza
-            const char *base64 = line + sizeof(digestPrefix) - 1;
-            if (name == NULL) {
-                LOGE("Unexpected digest:\n  %s\n", base64);
-                break;
-            }
-
-            const ZipEntry *entry = mzFindZipEntry(pArchive, name);
-            if (entry == NULL) {
-                LOGE("Missing file:\n  %s\n", name);
-                break;
-            }
-            if (!mzIsZipEntryIntact(pArchive, entry)) {
-                LOGE("Corrupt file:\n  %s\n", name);
-                break;
-            }
-            if (!unverified[mzGetZipEntryIndex(pArchive, entry)]) {
-                LOGE("Unexpected file:\n  %s\n", name);
-                break;
-            }
-
-            uint8_t expected[SHA_DIGEST_SIZE + 3], actual[SHA_DIGEST_SIZE];
-            int n = b64_pton(base64, expected, sizeof(expected));
-            if (n != SHA_DIGEST_SIZE) {
-                LOGE("Invalid base64:\n  %s\n  %s\n", name, base64);
-                break;
-            }
-
-            if (!digestEntry(pArchive, entry, &doneBytes, totalBytes, actual) ||
-                memcmp(expected, actual, SHA_DIGEST_SIZE) != 0) {
-                LOGE("Wrong digest:\n  %s\n", name);
-                break;
-            }
+    /* Parse the whole manifest into a list of jobs first.  Each entry is
+     * claimed as soon as its digest is seen, so that a second stanza for
+     * the same file shows up as unexpected.
+     */
+    struct VerifyPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.jobs = (struct VerifyJob *) malloc(
+            mzZipEntryCount(pArchive) * sizeof(struct VerifyJob));
+    if (pool.jobs == NULL) {
+        LOGE("Can't allocate verify jobs\n");
+        free(unverified);
+        return false;
+    }
 
-            LOGI("Verified %s\n", name);
-            unverified[mzGetZipEntryIndex(pArchive, entry)] = false;
-            free(name);
-            name = NULL;
-        }
+    struct Manifest *mf = (struct Manifest *) malloc(sizeof(struct Manifest));
+    if (mf == NULL) {
+        LOGE("Can't allocate manifest state\n");
+        free(pool.jobs);
+        free(unverified);
+        return false;
     }
+    mf->pArchive = pArchive;
+    mf->pool = &pool;
+    mf->unverified = unverified;
+    mf->haveName = false;
+    mf->error[0] = '\0';
 
-    if (name != NULL) free(name);
-    free(mfBuf);
+    bool ok = verifyManifest(pArchive, sfEntry, mfEntry, mfDigest, mf);
+    free(mf);
 
     for (i = 0; i < mzZipEntryCount(pArchive) && !unverified[i]; ++i) ;
     free(unverified);
 
+    // Now check the contents of everything the manifest lists.
+    if (ok) {
+        pool.failedJob = pool.numJobs;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.jobDone, NULL);
+        ok = runVerifyPool(&pool, totalBytes);
+        pthread_cond_destroy(&pool.jobDone);
+        pthread_mutex_destroy(&pool.lock);
+    }
+    free(pool.jobs);
+
     // This means we didn't get to the end of the manifest successfully.
-    if (line != NULL) return false;
+    if (!ok) return false;
 
     if (i < mzZipEntryCount(pArchive)) {
         const ZipEntry *entry = mzGetZipEntryAt(pArchive, i);
@@ -351,11 +721,295 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
 
 bool verify_jar_signature(const ZipArchive *pArchive,
         const RSAPublicKey *pKeys, int numKeys) {
-    const ZipEntry *sfEntry = verifySignature(pArchive, pKeys, numKeys);
+    uint8_t mfDigest[SHA_DIGEST_SIZE];
+    const ZipEntry *sfEntry =
+            verifySignature(pArchive, pKeys, numKeys, mfDigest);
     if (sfEntry == NULL) return false;
 
-    const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
-    if (mfEntry == NULL) return false;
+    return verifyArchive(pArchive, sfEntry, mfDigest);
+}
+
+
+/* Whole-file signatures.  The zip comment of a package signed this way
+ * ends with the signature and a 6-byte footer:
+ *
+ *     signature (RSANUMBYTES)
+ *     signature start, counted back from the end of the file (2, LE);
+ *         always RSANUMBYTES + 6
+ *     0xff 0xff
+ *     comment length, the same as in the EOCD record (2, LE)
+ *
+ * The signature covers the file up to the comment length field of the
+ * EOCD, so the comment itself can be filled in after signing.
+ */
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
+
+/* Return the comment length if the package has a whole-file signature
+ * footer, or -1. */
+static int getSignatureFooter(const ZipArchive *pArchive) {
+    long long length = mzGetZipArchiveLength(pArchive);
+    unsigned char footer[FOOTER_SIZE];
+    if (length < EOCD_HEADER_SIZE + FOOTER_SIZE ||
+            !mzReadZipArchiveRange(pArchive, length - FOOTER_SIZE,
+                    footer, FOOTER_SIZE)) {
+        return -1;
+    }
+    if (footer[2] != 0xff || footer[3] != 0xff) return -1;
+    return footer[4] | (footer[5] << 8);
+}
+
+/* mzProcessZipArchiveRange callback for the whole-file digest. */
+struct FileDigest {
+    MzSha1Context digest;
+    long long doneBytes, totalBytes;
+};
+
+static bool updateFileHash(const unsigned char *data, int dataLen,
+        void *cookie) {
+    struct FileDigest *fd = (struct FileDigest *) cookie;
+    mzSha1Update(&fd->digest, data, dataLen);
+    fd->doneBytes += dataLen;
+    ui_set_progress(fd->doneBytes * 1.0 / fd->totalBytes);
+    return true;
+}
+
+bool verify_whole_file_signature(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys) {
+    long long length = mzGetZipArchiveLength(pArchive);
+    int commentSize = getSignatureFooter(pArchive);
+    if (commentSize < 0) {
+        LOGE("No signature footer\n");
+        return false;
+    }
+
+    unsigned eocdSize = commentSize + EOCD_HEADER_SIZE;
+    if (length < eocdSize) {
+        LOGE("Comment size %d is bigger than the file\n", commentSize);
+        return false;
+    }
+
+    unsigned char *eocd = (unsigned char *) malloc(eocdSize);
+    if (eocd == NULL) {
+        LOGE("Can't allocate %u bytes for EOCD\n", eocdSize);
+        return false;
+    }
+    bool ok = false;
+    if (!mzReadZipArchiveRange(pArchive, length - eocdSize, eocd, eocdSize)) {
+        LOGE("Can't read EOCD\n");
+        goto bail;
+    }
+
+    // The footer has to belong to the EOCD record zip readers will use.
+    if (eocd[0] != 'P' || eocd[1] != 'K' || eocd[2] != 5 || eocd[3] != 6 ||
+            (eocd[20] | (eocd[21] << 8)) != commentSize) {
+        LOGE("Signature footer doesn't match EOCD\n");
+        goto bail;
+    }
+    unsigned i;
+    for (i = 4; i + 4 <= eocdSize; ++i) {
+        if (eocd[i] == 'P' && eocd[i+1] == 'K' &&
+                eocd[i+2] == 5 && eocd[i+3] == 6) {
+            // Another EOCD in the comment could point zip readers at
+            // data the signature doesn't cover.
+            LOGE("EOCD marker inside the comment\n");
+            goto bail;
+        }
+    }
 
-    return verifyArchive(pArchive, mfEntry);
+    // The signature sits right before the footer, and nothing else is
+    // accepted, so there's only one way to lay out a given package.
+    const unsigned char *footer = eocd + eocdSize - FOOTER_SIZE;
+    unsigned signatureStart = footer[0] | (footer[1] << 8);
+    if (signatureStart != RSANUMBYTES + FOOTER_SIZE ||
+            signatureStart > (unsigned) commentSize) {
+        LOGE("Bad signature start %u (comment size %d)\n",
+                signatureStart, commentSize);
+        goto bail;
+    }
+
+    // One pass over the raw file; nothing has to be decompressed.
+    struct FileDigest fd;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    mzSha1Init(&fd.digest);
+    fd.doneBytes = 0;
+    fd.totalBytes = length - commentSize - 2;
+    if (!mzProcessZipArchiveRange(pArchive, 0, fd.totalBytes,
+            updateFileHash, &fd)) {
+        LOGE("Can't digest package\n");
+        goto bail;
+    }
+    mzSha1Final(&fd.digest, digest);
+
+    const uint8_t *sig = footer - RSANUMBYTES;
+    int j;
+    for (j = 0; j < numKeys; ++j) {
+        if (RSA_verify(&pKeys[j], sig, RSANUMBYTES, digest)) {
+            LOGI("Verified whole-file signature with key %d\n", j);
+            ok = true;
+            goto bail;
+        }
+    }
+    LOGE("Whole-file signature doesn't match any key\n");
+
+bail:
+    free(eocd);
+    return ok;
+}
+
+
+bool verify_package_signature(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys) {
+    if (getSignatureFooter(pArchive) >= 0) {
+        return verify_whole_file_signature(pArchive, pKeys, numKeys);
+    }
+    return verify_jar_signature(pArchive, pKeys, numKeys);
+}
+
+
+/* The verification cache holds the keys of the last few packages that
+ * passed.  A key is the SHA-1 of everything the result depends on: the
+ * package's path, its identity and timestamps as fstat() sees them, the
+ * public keys, and the raw bytes from the central directory to the end
+ * of the file, which take in the whole-file signature or the CRCs of the
+ * jar signature files.  Any write to the package changes its ctime, so
+ * it can't be altered and still match.
+ *
+ * None of that is secret, so anyone who can write the cache file can
+ * make any package pass; see verifier.h for where it has to live.
+ */
+#define VERIFY_CACHE_MAGIC 0x43465256  // "VRFC"
+#define VERIFY_CACHE_VERSION 2
+#define VERIFY_CACHE_ENTRIES 8
+
+/* How long before verification starts the package must have last been
+ * changed for its result to be kept.  A write within the same timestamp
+ * tick wouldn't move ctime, and FAT only keeps times to 2 seconds. */
+#define VERIFY_CACHE_SETTLE_NS (2 * 1000000000LL)
+
+struct VerifyCache {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t keys[VERIFY_CACHE_ENTRIES][SHA_DIGEST_SIZE];  // newest first
+};
+
+static bool updateCacheKey(const unsigned char *data, int dataLen,
+        void *cookie) {
+    mzSha1Update((MzSha1Context *) cookie, data, dataLen);
+    return true;
+}
+
+/* Compute the cache key of a package, and return its ctime in
+ * nanoseconds in *changeTime. */
+static bool makeCacheKey(const char *path, const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys,
+        uint8_t key[SHA_DIGEST_SIZE], long long *changeTime) {
+    struct stat st;
+    long long dirOffset;
+    if (pArchive->fd < 0 || fstat(pArchive->fd, &st) != 0 ||
+            !mzGetZipArchiveDirectoryOffset(pArchive, &dirOffset)) {
+        return false;
+    }
+
+    struct {
+        uint64_t dev, ino, size;
+        int64_t mtime, mtimeNsec, ctime, ctimeNsec;
+    } id;
+    memset(&id, 0, sizeof(id));
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtime = st.st_mtime;
+    id.mtimeNsec = SYS_STAT_MTIME_NSEC(&st);
+    id.ctime = st.st_ctime;
+    id.ctimeNsec = SYS_STAT_CTIME_NSEC(&st);
+
+    MzSha1Context ctx;
+    mzSha1Init(&ctx);
+    mzSha1Update(&ctx, &id, sizeof(id));
+    mzSha1Update(&ctx, path, strlen(path) + 1);
+    mzSha1Update(&ctx, pKeys, numKeys * sizeof(RSAPublicKey));
+    if (!mzProcessZipArchiveRange(pArchive, dirOffset,
+            mzGetZipArchiveLength(pArchive) - dirOffset,
+            updateCacheKey, &ctx)) {
+        return false;
+    }
+    mzSha1Final(&ctx, key);
+    *changeTime = st.st_ctime * 1000000000LL + SYS_STAT_CTIME_NSEC(&st);
+    return true;
+}
+
+static void readVerifyCache(const char *cacheFile, struct VerifyCache *cache) {
+    int fd = open(cacheFile, O_RDONLY);
+    if (fd < 0 || read(fd, cache, sizeof(*cache)) != sizeof(*cache) ||
+            cache->magic != VERIFY_CACHE_MAGIC ||
+            cache->version != VERIFY_CACHE_VERSION) {
+        memset(cache, 0, sizeof(*cache));
+        cache->magic = VERIFY_CACHE_MAGIC;
+        cache->version = VERIFY_CACHE_VERSION;
+    }
+    if (fd >= 0) close(fd);
+}
+
+/* Add a key to the front of the cache, replacing the file atomically. */
+static void writeVerifyCache(const char *cacheFile,
+        const uint8_t key[SHA_DIGEST_SIZE]) {
+    struct VerifyCache cache;
+    readVerifyCache(cacheFile, &cache);
+    memmove(cache.keys[1], cache.keys[0],
+            (VERIFY_CACHE_ENTRIES - 1) * SHA_DIGEST_SIZE);
+    memcpy(cache.keys[0], key, SHA_DIGEST_SIZE);
+
+    char tmpName[PATH_MAX];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", cacheFile);
+    int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Can't create %s: %s\n", tmpName, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, &cache, sizeof(cache)) == sizeof(cache) &&
+            fsync(fd) == 0;
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(tmpName, cacheFile) != 0) {
+        LOGW("Can't write %s: %s\n", cacheFile, strerror(errno));
+        unlink(tmpName);
+    }
+}
+
+bool verify_package_signature_cached(const char *cacheFile, const char *path,
+        const ZipArchive *pArchive, const RSAPublicKey *pKeys, int numKeys) {
+    uint8_t key[SHA_DIGEST_SIZE];
+    long long changeTime;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long start = now.tv_sec * 1000000000LL + now.tv_nsec;
+    bool haveKey = cacheFile != NULL &&
+            makeCacheKey(path, pArchive, pKeys, numKeys, key, &changeTime);
+
+    if (haveKey) {
+        struct VerifyCache cache;
+        readVerifyCache(cacheFile, &cache);
+        int i;
+        for (i = 0; i < VERIFY_CACHE_ENTRIES; ++i) {
+            if (!memcmp(cache.keys[i], key, SHA_DIGEST_SIZE)) {
+                LOGI("%s was verified before; not checking again\n", path);
+                return true;
+            }
+        }
+    }
+
+    if (!verify_package_signature(pArchive, pKeys, numKeys)) return false;
+
+    // Only remember the result if the package can't have changed since
+    // we looked at it: same key afterwards, and not written to so close
+    // to the start that ctime alone couldn't tell the writes apart.
+    uint8_t after[SHA_DIGEST_SIZE];
+    long long changeTimeAfter;
+    if (haveKey && changeTime + VERIFY_CACHE_SETTLE_NS < start &&
+            makeCacheKey(path, pArchive, pKeys, numKeys, after,
+                    &changeTimeAfter) &&
+            !memcmp(key, after, SHA_DIGEST_SIZE)) {
+        writeVerifyCache(cacheFile, key);
+    }
+    return true;
 }
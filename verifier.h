@@ -27,4 +27,33 @@
 bool verify_jar_signature(const ZipArchive *pArchive,
         const RSAPublicKey *pKeys, int numKeys);
 
+/*
+ * Check a signature over the whole archive file, kept in a footer at the
+ * end of the zip comment.  Only the raw file is read, so this is much
+ * quicker than checking every entry.
+ */
+bool verify_whole_file_signature(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys);
+
+/*
+ * Check a package with whichever of the above it was signed for: the
+ * whole file if it has a signature footer, else the individual entries.
+ */
+bool verify_package_signature(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys);
+
+/*
+ * Same, but skip the check if "cacheFile" says this very file was
+ * verified with the same keys before, e.g. when an install is retried.
+ * Packages that pass are added to the cache.  "path" is the name the
+ * package was opened by; a NULL cacheFile disables the cache.
+ *
+ * A package found in the cache is trusted without any RSA check, and the
+ * cache entries are not authenticated, so "cacheFile" must be somewhere
+ * only recovery can write to and that is emptied on every boot, such as
+ * /tmp.  Never keep it on /cache or /data.
+ */
+bool verify_package_signature_cached(const char *cacheFile, const char *path,
+        const ZipArchive *pArchive, const RSAPublicKey *pKeys, int numKeys);
+
 #endif  /* _RECOVERY_VERIFIER_H */